@@ -0,0 +1,1495 @@
+/* ALSACapture.cpp
+ **
+ ** Copyright 2008-2009 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <math.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <media/AudioRecord.h>
+#include <hardware_legacy/power.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// Voice activity is kept for every 64 ring frames.
+#define ACTIVITY_SHIFT  6
+
+// Downsampling filter: phases per input frame, and zero crossings of the
+// windowed sinc on either side of its centre.
+#define FILTER_PHASE_SHIFT  6
+#define FILTER_ZEROS        16
+
+// ----------------------------------------------------------------------------
+
+//
+// One client of the capture ring.  A reader has its own position in the
+// ring and converts the hardware frames to its own rate and channel count
+// as it copies them out.
+//
+struct capture_reader_t
+{
+    uint32_t                rate;
+    uint32_t                channels;
+
+    uint32_t                pos;        // next ring frame to consume
+    uint32_t                step;       // hardware frames per output frame, Q16
+    uint32_t                phase;      // Q16, between prev and cur
+    int16_t                 prev[2];
+    int16_t                 cur[2];
+
+    // Low-pass polyphase filter, when the reader rate is below the
+    // hardware one; linear interpolation otherwise.
+    int16_t *               filter;     // Q14, taps per phase
+    int16_t *               history;    // taps frames twice, per channel
+    uint32_t                taps;
+    uint32_t                newest;     // in history
+
+    uint32_t                lost;       // frames, at the reader rate
+    uint32_t                lostTo;     // ring frames before it are counted
+    int32_t                 hwLostSeen;
+
+    int64_t                 position;   // frames read or lost, at the reader rate
+    int64_t                 frames;     // position of the last read
+    nsecs_t                 time;       // and when its first frame was captured
+    int                     speech;     // in the last read, or -1
+};
+
+//
+// Count hardware frames lost by a reader. Called with mWaitLock held.
+//
+static void lose(capture_reader_t *reader, uint32_t frames, uint32_t rate)
+{
+    uint32_t lost = (uint64_t)frames * reader->rate / rate;
+
+    reader->lost += lost;
+    reader->position += lost;
+}
+
+//
+// Of the ring frames from 'pos' up to 'end', those not counted as lost to
+// a reader yet, which they now are. Called with mWaitLock held.
+//
+static uint32_t uncounted(capture_reader_t *reader, uint32_t pos, uint32_t end)
+{
+    if ((int32_t)(reader->lostTo - pos) > 0) pos = reader->lostTo;
+    if ((int32_t)(end - pos) <= 0) return 0;
+
+    reader->lostTo = end;
+    return end - pos;
+}
+
+//
+// A Blackman-windowed sinc, 'd' input frames from its centre.
+//
+static double sincTap(double d, double cutoff, uint32_t half)
+{
+    if (fabs(d) >= half) return 0;
+
+    double x = 2 * M_PI * cutoff * d;
+    double w = 0.42 + 0.5 * cos(M_PI * d / half) + 0.08 * cos(2 * M_PI * d / half);
+
+    return w * (x == 0 ? 1 : sin(x) / x);
+}
+
+//
+// Set up a windowed sinc low-pass filter to downsample from 'from' to 'to'
+// Hz, cutting off a little below the new Nyquist frequency. Row p of the
+// table holds the taps for an output frame p / phases of an input frame
+// after the one 'taps' / 2 frames back, each row scaled to unity gain.
+//
+static bool setFilter(capture_reader_t *reader, uint32_t from, uint32_t to, int channels)
+{
+    double cutoff = 0.45 * to / from;   // cycles per input frame
+    uint32_t half = (uint32_t)ceil(FILTER_ZEROS / (2 * cutoff));
+    uint32_t taps = 2 * half;
+    uint32_t phases = 1 << FILTER_PHASE_SHIFT;
+
+    reader->filter = (int16_t *)malloc(phases * taps * sizeof(int16_t));
+    reader->history = (int16_t *)calloc(2 * taps * channels, sizeof(int16_t));
+    if (!reader->filter || !reader->history) {
+        free(reader->filter);
+        free(reader->history);
+        reader->filter = NULL;
+        reader->history = NULL;
+        return false;
+    }
+
+    reader->taps = taps;
+    reader->newest = 0;
+
+    for (uint32_t p = 0; p < phases; p++) {
+        int16_t *row = reader->filter + p * taps;
+        double offset = (double)p / phases - half;
+        double sum = 0;
+
+        // Tap k weighs the frame k frames before the newest.
+        for (uint32_t k = 0; k < taps; k++)
+            sum += sincTap(k + offset, cutoff, half);
+
+        for (uint32_t k = 0; k < taps; k++)
+            row[k] = (int16_t)floor(sincTap(k + offset, cutoff, half) / sum * (1 << 14) + 0.5);
+    }
+
+    return true;
+}
+
+static void account(capture_stats_t *stats, nsecs_t time)
+{
+    stats->count++;
+    stats->total += time;
+    if (time > stats->max) stats->max = time;
+}
+
+class ALSACaptureThread : public Thread
+{
+public:
+    ALSACaptureThread(ALSACapture *capture) :
+        Thread(false),
+        mCapture(capture)
+    {
+    }
+
+private:
+    virtual bool threadLoop()
+    {
+        return mCapture->captureLoop();
+    }
+
+    ALSACapture *           mCapture;
+};
+
+class ALSAProcessThread : public Thread
+{
+public:
+    ALSAProcessThread(ALSACapture *capture) :
+        Thread(false),
+        mCapture(capture)
+    {
+    }
+
+private:
+    virtual bool threadLoop()
+    {
+        return mCapture->processLoop();
+    }
+
+    ALSACapture *           mCapture;
+};
+
+// ----------------------------------------------------------------------------
+
+ALSACapture::ALSACapture(AudioHardwareALSA *parent) :
+    mParent(parent),
+    mHandle(0),
+    mClients(0),
+    mPipelined(false),
+    mStandby(false),
+    mHwParams(0),
+    mSwParams(0),
+    mRing(0),
+    mActivity(0),
+    mRingFrames(0),
+    mFrameSize(0),
+    mRawPos(0),
+    mWritePos(0),
+    mHwLost(0),
+    mCaptured(0),
+    mDefaultLatency(0),
+    mHistory(0),
+    mAnchorPos(0),
+    mAnchorTime(0),
+    mResumePos(0),
+    mRate(0),
+    mPeriodSize(0),
+    mProcessLostSeen(0),
+    mMaxBacklog(0),
+    mDuplexOut(0),
+    mDuplexDelay(0),
+    mRenderingThread(0),
+    mUnlinkPending(false)
+{
+    memset(&mConfig, 0, sizeof(mConfig));
+    memset(&mReadStats, 0, sizeof(mReadStats));
+    memset(&mProcessStats, 0, sizeof(mProcessStats));
+}
+
+ALSACapture::~ALSACapture()
+{
+    shutdown();
+    free(mRing);
+    free(mActivity);
+    if (mHwParams) snd_pcm_hw_params_free(mHwParams);
+    if (mSwParams) snd_pcm_sw_params_free(mSwParams);
+}
+
+status_t ALSACapture::attach(alsa_handle_t *handle, uint32_t devices, int mode)
+{
+    if (rendering()) return INVALID_OPERATION;
+
+    AutoMutex lock(mLock);
+
+    if (mClients || mHandle) {
+        // Everybody shares the configuration of the first client, or of
+        // the capture kept going for history.
+        mClients++;
+        return NO_ERROR;
+    }
+
+    // Capture runs on a copy of the device entry, so that what it is
+    // configured with never becomes the default of the next open.
+    mConfig = *handle;
+    handle = &mConfig;
+
+    // History mode keeps alsa.capture.history_ms of audio around for
+    // readers that start in the past, and trades latency for fewer wakeups
+    // with periods of a quarter of alsa.capture.history.latency_ms.
+    char value[PROPERTY_VALUE_MAX];
+    property_get("alsa.capture.history_ms", value, "0");
+    uint32_t history = atoi(value);
+
+    mHistory = history;
+    if (!mDefaultLatency) mDefaultLatency = handle->latency;
+
+    if (history) {
+        property_get("alsa.capture.history.latency_ms", value, "1000");
+        handle->latency = atoi(value) * 1000;
+    } else
+        handle->latency = mDefaultLatency;
+
+    // Multichannel mode opens all alsa.capture.mics microphones; the
+    // acoustics module beamforms them down, and readers get their own
+    // channel count out of the result.
+    property_get("alsa.capture.mics", value, "0");
+    int mics = atoi(value);
+    unsigned int requested = handle->channels;
+
+    if (mics > 1 && mics <= ACOUSTICS_MAX_MICS) handle->channels = mics;
+
+    status_t err = mParent->mALSADevice->open(handle, devices, mode);
+    if (err && handle->channels != requested) {
+        LOGW("Unable to capture from %d microphones, using %u channels", mics, requested);
+        handle->channels = requested;
+        err = mParent->mALSADevice->open(handle, devices, mode);
+    }
+    if (err) return err;
+
+    mHandle = handle;
+
+    acoustic_device_t *aDev = mParent->mAcousticDevice;
+    if (aDev) {
+        err = aDev->use_handle(aDev, handle);
+        if (err) {
+            mParent->mALSADevice->close(handle);
+            mHandle = NULL;
+            return err;
+        }
+    }
+
+    // The ring holds alsa.capture.ring_ms of audio, or the history, and
+    // at least a few hardware buffers.
+    property_get("alsa.capture.ring_ms", value, "500");
+
+    uint32_t ms = atoi(value);
+    if (ms < history) ms = history;
+
+    uint32_t frames = (uint64_t)handle->sampleRate * ms / 1000;
+    if (frames < 4 * handle->bufferSize) frames = 4 * handle->bufferSize;
+
+    mRingFrames = 1;
+    while (mRingFrames < frames) mRingFrames <<= 1;
+
+    mFrameSize = snd_pcm_frames_to_bytes(handle->handle, 1);
+    free(mRing);
+    // Zeroed, so that rewinding past the start of capture gives silence.
+    mRing = (char *)calloc(mRingFrames, mFrameSize);
+    free(mActivity);
+    mActivity = (uint8_t *)calloc(mRingFrames >> ACTIVITY_SHIFT, 1);
+    if (!mRing || !mActivity) {
+        if (aDev) aDev->cleanup(aDev);
+        mParent->mALSADevice->close(handle);
+        mHandle = NULL;
+        return NO_MEMORY;
+    }
+
+    // Pipelined mode (alsa.capture.pipeline) moves the acoustics module off
+    // the capture thread, when the module can process frames it did not
+    // read itself.
+    property_get("alsa.capture.pipeline", value, "1");
+    mPipelined = aDev && aDev->process && atoi(value);
+
+    mRawPos = 0;
+    mWritePos = 0;
+    mHwLost = 0;
+    mCaptured = 0;
+    mAnchorPos = 0;
+    mAnchorTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    mResumePos = 0;
+    mProcessLostSeen = 0;
+    memset(&mReadStats, 0, sizeof(mReadStats));
+    memset(&mProcessStats, 0, sizeof(mProcessStats));
+    mMaxBacklog = 0;
+    mStandby = false;
+    mClients = 1;
+
+    retainParams();
+
+    LOGV("Capture ring of %u frames at %u Hz, period %u frames%s",
+         mRingFrames, handle->sampleRate, handle->periodSize,
+         mPipelined ? ", pipelined" : "");
+
+    return NO_ERROR;
+}
+
+//
+// With capture history kept, capture goes on after the last client
+// leaves, so that a stream opened later, after a hotword say, can still
+// start from before it was opened.
+//
+void ALSACapture::detach()
+{
+    if (rendering()) return;
+
+    {
+        AutoMutex lock(mLock);
+        if (!mClients || --mClients) return;
+
+        if (mHistory) {
+            LOGV("Capture kept going for history");
+            return;
+        }
+    }
+
+    shutdown();
+}
+
+//
+// Stop capture and close the PCM.
+//
+void ALSACapture::shutdown()
+{
+    {
+        AutoMutex state(mStateLock);
+        stop();
+    }
+
+    AutoMutex lock(mLock);
+
+    if (!mHandle) return;
+
+    unlinkDuplex();
+
+    acoustic_device_t *aDev = mParent->mAcousticDevice;
+    if (aDev) aDev->cleanup(aDev);
+
+    mParent->mALSADevice->close(mHandle);
+    mHandle = NULL;
+
+    {
+        AutoMutex wait(mWaitLock);
+        mRate = 0;
+        mPeriodSize = 0;
+    }
+
+    free(mRing);
+    mRing = NULL;
+
+    free(mActivity);
+    mActivity = NULL;
+}
+
+//
+// Reopening the PCM has the threads stopped around it: the processing
+// thread runs the acoustics module without mLock, and the module works
+// from the capture handle as it does.
+//
+status_t ALSACapture::route(uint32_t devices, int mode)
+{
+    if (rendering()) return INVALID_OPERATION;
+
+    AutoMutex state(mStateLock);
+
+    {
+        AutoMutex lock(mLock);
+
+        if (!mHandle) return NO_INIT;
+        if (!devices) devices = mHandle->curDev;
+
+        if (mHandle->handle && mHandle->curDev == devices && mHandle->curMode == mode)
+            return NO_ERROR;
+    }
+
+    bool running;
+    {
+        AutoMutex wait(mWaitLock);
+        running = mThread != NULL;
+    }
+
+    if (running) stop();
+
+    status_t err;
+    {
+        AutoMutex lock(mLock);
+
+        unlinkDuplex();
+
+        err = mParent->mALSADevice->route(mHandle, devices, mode);
+
+        if (err == NO_ERROR) retainParams();
+    }
+
+    AutoMutex wait(mWaitLock);
+
+    // Capture starts over: the ring before here is not on the new clock.
+    mAnchorPos = mRawPos;
+    mAnchorTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    mResumePos = mRawPos;
+
+    if (running && err == NO_ERROR) start();
+
+    return err;
+}
+
+//
+// Keep the configuration of the open PCM, so that leaving standby only
+// has to hand it back to the driver, and its rate and period for
+// getParams(). Called with mLock held.
+//
+void ALSACapture::retainParams()
+{
+    {
+        AutoMutex wait(mWaitLock);
+        mRate = mHandle->sampleRate;
+        mPeriodSize = mHandle->periodSize;
+    }
+
+    if (!mHwParams && snd_pcm_hw_params_malloc(&mHwParams) < 0) mHwParams = NULL;
+    if (!mSwParams && snd_pcm_sw_params_malloc(&mSwParams) < 0) mSwParams = NULL;
+
+    if (mHwParams && snd_pcm_hw_params_current(mHandle->handle, mHwParams) < 0) {
+        snd_pcm_hw_params_free(mHwParams);
+        mHwParams = NULL;
+    }
+
+    if (mSwParams && snd_pcm_sw_params_current(mHandle->handle, mSwParams) < 0) {
+        snd_pcm_sw_params_free(mSwParams);
+        mSwParams = NULL;
+    }
+}
+
+//
+// Stop the DMA and, unless alsa.capture.standby.keep is set, release the
+// hardware configuration too, which lets the codec power the capture path
+// down. The PCM itself and the routing stay open.
+//
+void ALSACapture::standby()
+{
+    stop();
+
+    AutoMutex lock(mLock);
+
+    if (!mHandle || !mHandle->handle || mStandby) return;
+
+    // Dropping a linked PCM would stop the output too.
+    unlinkDuplex();
+
+    snd_pcm_drop(mHandle->handle);
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("alsa.capture.standby.keep", value, "0");
+
+    if (!atoi(value) && mHwParams && mSwParams)
+        snd_pcm_hw_free(mHandle->handle);
+
+    mStandby = true;
+
+    LOGV("Capture in standby");
+}
+
+//
+// Leave standby with the retained configuration: at most a hw_params and a
+// sw_params call, then prepare and start, instead of reopening the PCM.
+//
+status_t ALSACapture::resume()
+{
+    AutoMutex lock(mLock);
+
+    if (!mHandle || !mHandle->handle) return NO_INIT;
+    if (!mStandby) return NO_ERROR;
+
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    int err = 0;
+
+    if (snd_pcm_state(mHandle->handle) == SND_PCM_STATE_OPEN) {
+        if (!mHwParams || !mSwParams) return NO_INIT;
+
+        err = snd_pcm_hw_params(mHandle->handle, mHwParams);
+        if (err >= 0) err = snd_pcm_sw_params(mHandle->handle, mSwParams);
+    }
+
+    if (err >= 0) err = snd_pcm_prepare(mHandle->handle);
+    if (err >= 0) err = snd_pcm_start(mHandle->handle);
+
+    if (err < 0) {
+        LOGE("Unable to resume capture: %s", snd_strerror(err));
+        return err;
+    }
+
+    {
+        AutoMutex wait(mWaitLock);
+        mAnchorPos = mRawPos;
+        mAnchorTime = systemTime(SYSTEM_TIME_MONOTONIC);
+        mResumePos = mRawPos;
+    }
+
+    mStandby = false;
+
+    LOGV("Capture resumed in %lld us", ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+
+    return NO_ERROR;
+}
+
+//
+// Link the capture and playback PCMs, so that they are stopped, prepared
+// and started as one, and restart them with the playback primed with
+// alsa.duplex.prime_periods periods. The capture thread renders for 'out'
+// from then on.
+//
+status_t ALSACapture::link(AudioStreamOutALSA *out)
+{
+    if (rendering()) return INVALID_OPERATION;
+
+    AutoMutex lock(mLock);
+
+    if (mDuplexOut) return mDuplexOut == out ? NO_ERROR : INVALID_OPERATION;
+    if (!mHandle || !mHandle->handle || mStandby) return INVALID_OPERATION;
+
+    {
+        AutoMutex wait(mWaitLock);
+        if (mThread == NULL) return INVALID_OPERATION;
+    }
+
+    snd_pcm_t *capture = mHandle->handle;
+    snd_pcm_t *playback = out->mHandle->handle;
+    snd_pcm_uframes_t bufferSize, periodSize, outBufferSize, outPeriodSize;
+
+    if (!playback ||
+        snd_pcm_get_params(capture, &bufferSize, &periodSize) < 0 ||
+        snd_pcm_get_params(playback, &outBufferSize, &outPeriodSize) < 0)
+        return NO_INIT;
+
+    // A period in for every period out.
+    if (mHandle->sampleRate != out->mHandle->sampleRate || periodSize != outPeriodSize) {
+        LOGW("No duplex with capture at %u Hz, %u frame periods, playback at %u Hz, %u",
+             mHandle->sampleRate, (unsigned int)periodSize,
+             out->mHandle->sampleRate, (unsigned int)outPeriodSize);
+        return BAD_VALUE;
+    }
+
+    int err = snd_pcm_link(capture, playback);
+    if (err < 0) {
+        LOGW("No duplex, unable to link the PCMs: %s", snd_strerror(err));
+        return err;
+    }
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("alsa.duplex.prime_periods", value, "2");
+
+    snd_pcm_uframes_t prime = atoi(value) * periodSize;
+    if (prime < periodSize) prime = periodSize;
+    if (prime > outBufferSize) prime = outBufferSize - outBufferSize % periodSize;
+
+    // What was captured and not read yet goes with the drop.
+    snd_pcm_sframes_t pending = snd_pcm_avail(capture);
+    nsecs_t stopped = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    snd_pcm_drop(capture);
+    err = snd_pcm_prepare(capture);
+
+    // The playback may start itself on its start threshold, and the
+    // capture with it.
+    mDuplexOut = out;
+    mUnlinkPending = false;
+    if (err >= 0 && !renderDuplex(prime)) err = -EIO;
+
+    // The callback may have stopped rendering already.
+    if (err >= 0 && !mDuplexOut) err = -ECANCELED;
+    mDuplexOut = NULL;
+    if (err >= 0 && snd_pcm_state(capture) != SND_PCM_STATE_RUNNING)
+        err = snd_pcm_start(capture);
+
+    nsecs_t started = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    if (pending < 0) pending = 0;
+    pending += (started - stopped) * mHandle->sampleRate / 1000000000LL;
+    if (pending > 0) lost(mRawPos, pending);
+
+    {
+        AutoMutex wait(mWaitLock);
+        mAnchorPos = mRawPos;
+        mAnchorTime = started;
+    }
+
+    if (err < 0) {
+        LOGE("Unable to start duplex: %s", snd_strerror(err));
+        snd_pcm_unlink(capture);
+        if (snd_pcm_state(capture) != SND_PCM_STATE_RUNNING) {
+            snd_pcm_prepare(capture);
+            snd_pcm_start(capture);
+        }
+        return err;
+    }
+
+    mDuplexOut = out;
+    mDuplexDelay = prime + periodSize;
+
+    LOGI("Duplex started, %u frames from playback to capture", (unsigned int)mDuplexDelay);
+
+    return NO_ERROR;
+}
+
+//
+// The output calls this to stop the capture thread rendering for it, and
+// may do so from its callback, on the thread rendering with mLock held:
+// the unlink is then left to that thread, once the callback returns.
+//
+void ALSACapture::unlink(AudioStreamOutALSA *out)
+{
+    if (mRenderingThread == androidGetThreadId()) {
+        mUnlinkPending = true;
+        return;
+    }
+
+    AutoMutex lock(mLock);
+
+    if (mDuplexOut == out) unlinkDuplex();
+}
+
+//
+// Have the linked output render, and carry out an unlink its callback asked
+// for. Called with mLock held.
+//
+bool ALSACapture::renderDuplex(snd_pcm_uframes_t limit)
+{
+    mRenderingThread = androidGetThreadId();
+    bool rendered = mDuplexOut->render(limit);
+    mRenderingThread = 0;
+
+    if (mUnlinkPending) {
+        mUnlinkPending = false;
+        unlinkDuplex();
+    }
+
+    return rendered;
+}
+
+//
+// The capture thread is stopping, the PCM changing or the output asked to
+// be let go: the output renders on a thread of its own again, and takes
+// the route it deferred. Called with mLock held.
+//
+//
+// Render callbacks run with mLock held, and calls from them that need it,
+// or mStateLock, or wait for capture, would wait on themselves: those are
+// refused.
+//
+bool ALSACapture::rendering()
+{
+    if (mRenderingThread != androidGetThreadId()) return false;
+
+    LOGE("Capture called from a render callback, refused");
+    return true;
+}
+
+void ALSACapture::unlinkDuplex()
+{
+    AudioStreamOutALSA *out = mDuplexOut;
+
+    if (!out) return;
+
+    if (mHandle && mHandle->handle) snd_pcm_unlink(mHandle->handle);
+    mDuplexOut = NULL;
+
+    AutoMutex lock(out->mLock);
+    out->leaveDuplex();
+
+    LOGV("Duplex stopped");
+}
+
+//
+// Called with mWaitLock held.
+//
+status_t ALSACapture::start()
+{
+    if (mThread != NULL) return NO_ERROR;
+
+    if (mPipelined) {
+        mProcessThread = new ALSAProcessThread(this);
+        status_t err = mProcessThread->run("ALSACaptureProcess", ANDROID_PRIORITY_URGENT_AUDIO);
+        if (err != NO_ERROR) {
+            mProcessThread.clear();
+            return err;
+        }
+    }
+
+    mThread = new ALSACaptureThread(this);
+    return mThread->run("ALSACapture", ANDROID_PRIORITY_URGENT_AUDIO);
+}
+
+void ALSACapture::stop()
+{
+    sp<ALSACaptureThread> thread;
+    sp<ALSAProcessThread> process;
+
+    {
+        AutoMutex lock(mWaitLock);
+        thread = mThread;
+        mThread.clear();
+        // The processing thread sleeps on mWait, and leaves when it finds
+        // itself gone.
+        process = mProcessThread;
+        mProcessThread.clear();
+        mWait.broadcast();
+    }
+
+    if (thread != NULL) thread->requestExitAndWait();
+    if (process != NULL) process->requestExitAndWait();
+
+    if (thread == NULL && process == NULL) return;
+
+    AutoMutex wait(mWaitLock);
+    mWait.broadcast();
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// A reader with a start time begins with the frames captured from that
+// CLOCK_MONOTONIC time on, as far as the ring still holds them.
+//
+capture_reader_t *ALSACapture::addReader(uint32_t rate, uint32_t channels, nsecs_t startTime)
+{
+    if (!mHandle || !rate || !channels || rendering()) return NULL;
+
+    AutoMutex state(mStateLock);
+
+    if (resume() != NO_ERROR) return NULL;
+
+    capture_reader_t *reader = new capture_reader_t;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->rate = rate;
+    reader->channels = channels;
+    reader->step = ((uint64_t)mHandle->sampleRate << 16) / rate;
+    reader->phase = 0x10000;
+
+    if (rate < mHandle->sampleRate && mHandle->format == SND_PCM_FORMAT_S16_LE &&
+        !setFilter(reader, mHandle->sampleRate, rate, channels))
+        LOGW("No memory for the %u Hz capture filter, reading unfiltered", rate);
+    reader->speech = -1;
+
+    {
+        AutoMutex lock(mWaitLock);
+
+        uint32_t writePos = android_atomic_acquire_load(&mWritePos);
+        reader->pos = writePos;
+
+        if (startTime) {
+            // Frames between the start and the last anchor, plus whatever
+            // has been written since.
+            int64_t back = (int32_t)(writePos - mAnchorPos);
+            back += (mAnchorTime - startTime) * mHandle->sampleRate / 1000000000LL;
+
+            // No further than capture has run since it last started: the
+            // anchor only knows the time from there, and before it is a gap.
+            int64_t limit = mRingFrames - mHandle->periodSize;
+            int64_t captured = (int32_t)(writePos - mResumePos);
+            if (limit > captured) limit = captured;
+            if (back > limit) back = limit;
+            if (back > 0) reader->pos -= back;
+        }
+
+        reader->lostTo = reader->pos;
+        reader->hwLostSeen = android_atomic_acquire_load(&mHwLost);
+        mReaders.add(reader);
+
+        start();
+    }
+
+    return reader;
+}
+
+//
+// The last reader to leave puts capture in standby, unless capture
+// history is kept for readers to come.
+//
+void ALSACapture::removeReader(capture_reader_t *reader)
+{
+    if (rendering()) return;
+
+    AutoMutex state(mStateLock);
+    bool idle;
+
+    {
+        AutoMutex lock(mWaitLock);
+
+        for (size_t i = 0; i < mReaders.size(); i++)
+            if (mReaders[i] == reader) {
+                mReaders.removeAt(i);
+                break;
+            }
+
+        idle = mReaders.isEmpty();
+    }
+
+    free(reader->filter);
+    free(reader->history);
+    delete reader;
+
+    if (idle && !mHistory) standby();
+}
+
+status_t ALSACapture::addAcoustics(int flags)
+{
+    if (rendering()) return INVALID_OPERATION;
+
+    AutoMutex state(mStateLock);
+
+    mAcoustics.add(flags);
+
+    return applyAcoustics(NULL);
+}
+
+void ALSACapture::removeAcoustics(int flags)
+{
+    if (rendering()) return;
+
+    AutoMutex state(mStateLock);
+
+    for (size_t i = 0; i < mAcoustics.size(); i++)
+        if (mAcoustics[i] == flags) {
+            mAcoustics.removeAt(i);
+            break;
+        }
+
+    if (!mAcoustics.isEmpty()) applyAcoustics(NULL);
+}
+
+status_t ALSACapture::setAcousticParams(void *params)
+{
+    if (rendering()) return INVALID_OPERATION;
+
+    AutoMutex state(mStateLock);
+
+    return applyAcoustics(params);
+}
+
+//
+// Set the acoustics module up with the union of the input stream flags.
+// Called with mStateLock held.
+//
+status_t ALSACapture::applyAcoustics(void *params)
+{
+    acoustic_device_t *aDev = mParent->mAcousticDevice;
+    int flags = 0;
+
+    if (!aDev) return NO_ERROR;
+
+    for (size_t i = 0; i < mAcoustics.size(); i++)
+        flags |= mAcoustics[i];
+
+    return aDev->set_params(aDev, (AudioSystem::audio_in_acoustics)flags, params);
+}
+
+//
+// Under mWaitLock rather than mLock, which a duplex render callback may
+// be holding, or a reopen.
+//
+status_t ALSACapture::getParams(uint32_t *rate, snd_pcm_uframes_t *periodSize)
+{
+    AutoMutex lock(mWaitLock);
+
+    if (!mRate) return NO_INIT;
+
+    if (rate) *rate = mRate;
+    if (periodSize) *periodSize = mPeriodSize;
+
+    return NO_ERROR;
+}
+
+status_t ALSACapture::getTimestamp(capture_reader_t *reader, int64_t *frames, nsecs_t *time)
+{
+    if (!reader) return NO_INIT;
+
+    AutoMutex lock(mWaitLock);
+
+    if (!reader->time) return INVALID_OPERATION;
+
+    if (frames) *frames = reader->frames;
+    if (time) *time = reader->time;
+
+    return NO_ERROR;
+}
+
+status_t ALSACapture::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    AutoMutex lock(mWaitLock);
+
+    if (!mHandle) return NO_ERROR;
+
+    snprintf(buffer, SIZE, "Capture %s: %u Hz, %d readers, ring %u frames, period %u frames\n",
+             mPipelined ? "pipelined" : "inline", mHandle->sampleRate, mReaders.size(),
+             mRingFrames, (unsigned int)mHandle->periodSize);
+    result.append(buffer);
+
+    const capture_stats_t *stats[] = { &mReadStats, &mProcessStats };
+    const char *names[] = { "read", "process" };
+
+    for (int i = 0; i < 2; i++) {
+        if (!stats[i]->count) continue;
+        snprintf(buffer, SIZE, "  %-8s %u periods, %lld us average, %lld us max\n",
+                 names[i], stats[i]->count, ns2us(stats[i]->total) / stats[i]->count,
+                 ns2us(stats[i]->max));
+        result.append(buffer);
+    }
+
+    if (mPipelined) {
+        snprintf(buffer, SIZE, "  processing backlog %u frames max\n", mMaxBacklog);
+        result.append(buffer);
+    }
+
+    if (mDuplexOut) {
+        snprintf(buffer, SIZE, "  duplex, %u frames from playback to capture\n",
+                 (unsigned int)mDuplexDelay);
+        result.append(buffer);
+    }
+
+    ::write(fd, result.string(), result.size());
+
+    return NO_ERROR;
+}
+
+int ALSACapture::voiceActivity(capture_reader_t *reader)
+{
+    if (!reader) return -1;
+
+    AutoMutex lock(mWaitLock);
+
+    return reader->speech;
+}
+
+unsigned int ALSACapture::framesLost(capture_reader_t *reader)
+{
+    if (!reader) return 0;
+
+    AutoMutex lock(mWaitLock);
+
+    unsigned int lost = reader->lost;
+    reader->lost = 0;
+
+    return lost;
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Capture time of a ring position, from the last anchor. Called with
+// mWaitLock held.
+//
+nsecs_t ALSACapture::frameTime(uint32_t pos)
+{
+    return mAnchorTime + (int64_t)(int32_t)(pos - mAnchorPos) *
+        1000000000LL / mHandle->sampleRate;
+}
+
+//
+// Record the voice activity of the 'frames' ring frames from 'pos' on:
+// what the acoustics module made of them, or -1 if it did not say.
+//
+void ALSACapture::markActivity(uint32_t pos, uint32_t frames, int speech)
+{
+    if (!frames) return;
+
+    uint8_t state = speech < 0 ? 0 : speech ? 2 : 1;
+    uint32_t mask = (mRingFrames >> ACTIVITY_SHIFT) - 1;
+
+    for (uint32_t i = pos >> ACTIVITY_SHIFT; i <= (pos + frames - 1) >> ACTIVITY_SHIFT; i++)
+        mActivity[i & mask] = state;
+}
+
+//
+// Speech anywhere in the ring frames from 'pos' up to 'end' gives 1, only
+// silence 0, and nothing known -1.
+//
+int ALSACapture::activity(uint32_t pos, uint32_t end)
+{
+    uint32_t mask = (mRingFrames >> ACTIVITY_SHIFT) - 1;
+    uint8_t state = 0;
+
+    if (pos == end) return -1;
+
+    for (uint32_t i = pos >> ACTIVITY_SHIFT; i <= (end - 1) >> ACTIVITY_SHIFT; i++)
+        if (mActivity[i & mask] > state) state = mActivity[i & mask];
+
+    return state - 1;
+}
+
+//
+// Count frames the hardware could not deliver, starting at ring position
+// 'pos'. Called with mLock held.
+//
+void ALSACapture::lost(uint32_t pos, snd_pcm_sframes_t frames)
+{
+    nsecs_t time;
+
+    {
+        AutoMutex lock(mWaitLock);
+        time = frameTime(pos);
+    }
+
+    android_atomic_add(frames, &mHwLost);
+
+    LOGW("Capture lost %ld frames captured from %lld ns on", frames, time);
+}
+
+//
+// With the stop threshold at the boundary an overrun does not stop the
+// PCM; the hardware just keeps writing over the oldest frames. Skip only
+// those, keeping the rest of the buffer. Called with mLock held.
+//
+void ALSACapture::resync(uint32_t pos)
+{
+    snd_pcm_sframes_t avail = snd_pcm_avail(mHandle->handle);
+
+    if (avail <= (snd_pcm_sframes_t)mHandle->bufferSize) return;
+
+    snd_pcm_sframes_t skipped = snd_pcm_forward(mHandle->handle, avail - mHandle->bufferSize);
+
+    if (skipped > 0) lost(pos, skipped);
+}
+
+bool ALSACapture::captureLoop()
+{
+    uint32_t pos = mRawPos;
+    uint32_t offset = pos & (mRingFrames - 1);
+
+    // Read straight into the ring, never across its end.
+    snd_pcm_sframes_t frames = mHandle->periodSize ? mHandle->periodSize : 256;
+    if ((uint32_t)frames > mRingFrames - offset) frames = mRingFrames - offset;
+
+    char *dst = mRing + offset * mFrameSize;
+    snd_pcm_sframes_t n = 0;
+    uint32_t anchorPos;
+    nsecs_t anchorTime;
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t end;
+
+    {
+        AutoMutex lock(mLock);
+
+        if (!mHandle->handle) {
+            LOGE("Capture PCM is not open");
+            return false;
+        }
+
+        resync(pos);
+
+        // In pipelined mode the acoustics module is run by the processing
+        // thread instead.
+        acoustic_device_t *aDev = mPipelined ? NULL : mParent->mAcousticDevice;
+
+        if (aDev && aDev->timestamp) {
+            nsecs_t time;
+            {
+                AutoMutex wait(mWaitLock);
+                time = frameTime(pos);
+            }
+            aDev->timestamp(aDev, SND_PCM_STREAM_CAPTURE, mCaptured, time);
+        }
+
+        // Complete the period, unless something goes wrong.
+        while (n < frames) {
+            snd_pcm_sframes_t r;
+
+            // An acoustics module read method replaces the plain PCM read.
+            if (aDev && aDev->read) {
+                r = aDev->read(aDev, dst + n * mFrameSize, (frames - n) * mFrameSize);
+                if (r > 0) r /= mFrameSize;
+            } else
+                r = snd_pcm_readi(mHandle->handle, dst + n * mFrameSize, frames - n);
+
+            if (r == -EAGAIN || r == -EINTR) continue;
+
+            if (r < 0) {
+                int err = snd_pcm_recover(mHandle->handle, r, 1);
+
+                if (aDev && aDev->recover) aDev->recover(aDev, err);
+
+                // Whatever was captured between the first frame we did not
+                // get and now is gone, including what the recovery dropped.
+                nsecs_t missing;
+                {
+                    AutoMutex wait(mWaitLock);
+                    missing = systemTime(SYSTEM_TIME_MONOTONIC) - frameTime(pos + n);
+                }
+                if (missing > 0)
+                    lost(pos + n, missing * mHandle->sampleRate / 1000000000LL);
+
+                if (err < 0) {
+                    LOGE("Capture failed: %s", snd_strerror(err));
+                    usleep(mHandle->latency / 4);
+                }
+                break;
+            }
+
+            n += r;
+        }
+
+        // A period has gone out too; the output renders the room there is.
+        if (mDuplexOut) renderDuplex(0);
+
+        if (!n) return true;
+
+        end = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        if (aDev) markActivity(pos, n, aDev->activity ? aDev->activity(aDev) : -1);
+
+        // The driver timestamps the moment the newest of the frames still
+        // waiting in the hardware buffer was captured. Without a usable
+        // monotonic stamp, the last frame read was captured about now.
+        snd_pcm_uframes_t waiting;
+        snd_htimestamp_t tstamp;
+
+        anchorPos = pos + n;
+        anchorTime = end;
+
+        if (snd_pcm_htimestamp(mHandle->handle, &waiting, &tstamp) == 0) {
+            nsecs_t time = seconds(tstamp.tv_sec) + tstamp.tv_nsec;
+
+            if (time <= anchorTime && anchorTime - time < mHandle->latency * 1000LL) {
+                anchorPos += waiting;
+                anchorTime = time;
+            }
+        }
+    }
+
+    AutoMutex lock(mWaitLock);
+
+    android_atomic_release_store(pos + n, &mRawPos);
+    if (!mPipelined) android_atomic_release_store(pos + n, &mWritePos);
+
+    mCaptured += n;
+    mAnchorPos = anchorPos;
+    mAnchorTime = anchorTime;
+
+    account(&mReadStats, end - begin);
+
+    mWait.broadcast();
+
+    return true;
+}
+
+//
+// Run the acoustics module over the frames captured since the last call, a
+// period at a time, in place in the ring, and hand them to the readers.
+//
+bool ALSACapture::processLoop()
+{
+    uint32_t pos = mWritePos;
+    uint32_t rawPos;
+    int64_t frames;
+    nsecs_t time;
+
+    {
+        AutoMutex lock(mWaitLock);
+
+        if (mProcessThread == NULL) return false;
+
+        rawPos = android_atomic_acquire_load(&mRawPos);
+        if (rawPos == pos) {
+            mWait.wait(mWaitLock);
+            return true;
+        }
+
+        frames = mCaptured - (rawPos - pos);
+        time = frameTime(pos);
+    }
+
+    acoustic_device_t *aDev = mParent->mAcousticDevice;
+    uint32_t backlog = rawPos - pos;
+
+    if (backlog > mRingFrames / 2) {
+        // Rather than have the capture thread overwrite frames under us,
+        // hand the backlog on as it is and start over.
+        LOGW("Capture processing %u frames behind, passing them through", backlog);
+
+        if (aDev->recover) aDev->recover(aDev, 0);
+        markActivity(pos, backlog, -1);
+
+        AutoMutex lock(mWaitLock);
+        android_atomic_release_store(rawPos, &mWritePos);
+        mWait.broadcast();
+        return true;
+    }
+
+    // Frames went missing upstream: the module realigns its blocks.
+    int32_t hwLost = android_atomic_acquire_load(&mHwLost);
+    if (hwLost != mProcessLostSeen) {
+        if (aDev->recover) aDev->recover(aDev, 0);
+        mProcessLostSeen = hwLost;
+    }
+
+    uint32_t offset = pos & (mRingFrames - 1);
+    uint32_t n = backlog;
+    if (mHandle->periodSize && n > mHandle->periodSize) n = mHandle->periodSize;
+    if (n > mRingFrames - offset) n = mRingFrames - offset;
+
+    if (aDev->timestamp) aDev->timestamp(aDev, SND_PCM_STREAM_CAPTURE, frames, time);
+
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    ssize_t err = aDev->process(aDev, mRing + offset * mFrameSize, n * mFrameSize);
+    nsecs_t end = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    // The frames go to the readers either way, but unprocessed ones say
+    // nothing about voice activity.
+    if (err < 0) {
+        LOGW("Capture processing failed: %s", strerror(-err));
+        if (aDev->recover) aDev->recover(aDev, err);
+        markActivity(pos, n, -1);
+    } else
+        markActivity(pos, n, aDev->activity ? aDev->activity(aDev) : -1);
+
+    AutoMutex lock(mWaitLock);
+
+    android_atomic_release_store(pos + n, &mWritePos);
+
+    account(&mProcessStats, end - begin);
+    if (backlog > mMaxBacklog) mMaxBacklog = backlog;
+
+    mWait.broadcast();
+
+    return true;
+}
+
+//
+// Copy out up to 'frames' reader frames from at most 'avail' ring frames.
+// Filtered readers lag the ring by half the filter length.
+//
+size_t ALSACapture::convert(capture_reader_t *reader, void *buffer,
+                            size_t frames, uint32_t avail)
+{
+    uint32_t mask = mRingFrames - 1;
+    int hwChannels = mHandle->channels;
+
+    if (reader->rate == mHandle->sampleRate && reader->channels == (uint32_t)hwChannels) {
+        size_t n = frames < avail ? frames : avail;
+        uint32_t offset = reader->pos & mask;
+        size_t first = n < mRingFrames - offset ? n : mRingFrames - offset;
+
+        memcpy(buffer, mRing + offset * mFrameSize, first * mFrameSize);
+        memcpy((char *)buffer + first * mFrameSize, mRing, (n - first) * mFrameSize);
+
+        reader->pos += n;
+        return n;
+    }
+
+    // Rate and channel conversion, 16 bit only.
+    const int16_t *ring = (const int16_t *)mRing;
+    int16_t *out = (int16_t *)buffer;
+    int channels = reader->channels;
+    size_t produced = 0;
+
+    while (produced < frames) {
+        while (reader->phase >= 0x10000) {
+            if (!avail) return produced;
+
+            const int16_t *in = ring + (reader->pos & mask) * hwChannels;
+
+            reader->prev[0] = reader->cur[0];
+            reader->prev[1] = reader->cur[1];
+
+            if (channels == 1) {
+                int sum = 0;
+                for (int c = 0; c < hwChannels; c++) sum += in[c];
+                reader->cur[0] = sum / hwChannels;
+            } else {
+                reader->cur[0] = in[0];
+                reader->cur[1] = hwChannels > 1 ? in[1] : in[0];
+            }
+
+            // Each channel's history is kept twice over, so that the
+            // taps frames up to the newest are always in one piece.
+            if (reader->filter) {
+                uint32_t taps = reader->taps;
+                reader->newest = reader->newest ? reader->newest - 1 : taps - 1;
+                for (int c = 0; c < channels; c++) {
+                    int16_t *history = reader->history + c * 2 * taps;
+                    history[reader->newest] = history[reader->newest + taps] = reader->cur[c];
+                }
+            }
+
+            reader->pos++;
+            avail--;
+            reader->phase -= 0x10000;
+        }
+
+        if (reader->filter) {
+            uint32_t taps = reader->taps;
+            const int16_t *row = reader->filter +
+                (reader->phase >> (16 - FILTER_PHASE_SHIFT)) * taps;
+
+            for (int c = 0; c < channels; c++) {
+                const int16_t *history = reader->history + c * 2 * taps + reader->newest;
+                int32_t sum = 1 << 13;
+
+                for (uint32_t k = 0; k < taps; k++)
+                    sum += history[k] * row[k];
+
+                sum >>= 14;
+                *out++ = sum > 32767 ? 32767 : sum < -32768 ? -32768 : sum;
+            }
+        } else {
+            for (int c = 0; c < channels; c++)
+                *out++ = reader->prev[c] +
+                    (((int32_t)reader->cur[c] - reader->prev[c]) * (int32_t)reader->phase >> 16);
+        }
+
+        produced++;
+        reader->phase += reader->step;
+    }
+
+    return produced;
+}
+
+ssize_t ALSACapture::read(capture_reader_t *reader, void *buffer, size_t frames)
+{
+    if (!reader || !mRing) return NO_INIT;
+    if (rendering()) return INVALID_OPERATION;
+
+    size_t frameSize = mFrameSize / mHandle->channels * reader->channels;
+    size_t done = 0;
+    int speech = -1;
+
+    while (done < frames) {
+        uint32_t writePos = android_atomic_acquire_load(&mWritePos);
+        uint32_t avail = writePos - reader->pos;
+
+        // Captured frames may be ahead of processed ones; it is the capture
+        // that overwrites.
+        uint32_t behind = android_atomic_acquire_load(&mRawPos) - reader->pos;
+
+        if (behind + mHandle->periodSize > mRingFrames) {
+            // The writer lapped us, or is reading over the next frames: skip
+            // what is overwritten, plus a period of headroom so we are not
+            // lapped again straight away.
+            uint32_t skip = behind - mRingFrames + mHandle->periodSize;
+            if (skip > avail) skip = avail;
+
+            AutoMutex lock(mWaitLock);
+            lose(reader, uncounted(reader, reader->pos, reader->pos + skip), mHandle->sampleRate);
+
+            reader->pos += skip;
+            avail -= skip;
+        }
+
+        if (!avail) {
+            AutoMutex lock(mWaitLock);
+
+            if (mThread == NULL) return done ? (ssize_t)done : (ssize_t)NO_INIT;
+
+            if (android_atomic_acquire_load(&mWritePos) == (int32_t)writePos &&
+                mWait.waitRelative(mWaitLock, seconds(1)) == TIMED_OUT) {
+                LOGW("Capture read timed out");
+                return done ? (ssize_t)done : (ssize_t)TIMED_OUT;
+            }
+            continue;
+        }
+
+        uint32_t start = reader->pos;
+
+        if (!done) {
+            // Stamp the buffer with its first frame.
+            AutoMutex lock(mWaitLock);
+            reader->frames = reader->position;
+            reader->time = frameTime(start - (reader->filter ? reader->taps / 2 : 0));
+        }
+
+        char *out = (char *)buffer + done * frameSize;
+        size_t n = convert(reader, out, frames - done, avail);
+        done += n;
+        reader->position += n;
+
+        int state = activity(start, reader->pos);
+        if (state > speech) speech = state;
+
+        // Frames the capture overwrote while we copied them, or may be
+        // overwriting with the period it is reading, are lost as well, and
+        // go out as silence: the output frames made from them, and those
+        // the filter or interpolation mixed them into.
+        uint32_t safe = android_atomic_acquire_load(&mRawPos) + mHandle->periodSize - mRingFrames;
+
+        if ((int32_t)(safe - start) > 0) {
+            uint32_t end = (int32_t)(reader->pos - safe) < 0 ? reader->pos : safe;
+            uint32_t span = end - start;
+
+            if (reader->filter)
+                span += reader->taps;
+            else if (reader->rate != mHandle->sampleRate || reader->channels != mHandle->channels)
+                span++;
+
+            size_t bad = ((uint64_t)span * reader->rate + mHandle->sampleRate - 1) /
+                         mHandle->sampleRate;
+
+            memset(out, 0, (bad < n ? bad : n) * frameSize);
+
+            // They went out, as silence, so the position has them already.
+            AutoMutex lock(mWaitLock);
+            reader->lost += (uint64_t)uncounted(reader, start, end) * reader->rate /
+                            mHandle->sampleRate;
+        }
+    }
+
+    AutoMutex lock(mWaitLock);
+
+    int32_t hwLost = android_atomic_acquire_load(&mHwLost);
+    if (hwLost != reader->hwLostSeen) {
+        lose(reader, hwLost - reader->hwLostSeen, mHandle->sampleRate);
+        reader->hwLostSeen = hwLost;
+    }
+
+    reader->speech = speech;
+
+    return done;
+}
+
+}       // namespace android
@@ -22,10 +22,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <poll.h>
 
 #define LOG_TAG "ALSAControl"
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
@@ -36,23 +38,66 @@
 namespace android
 {
 
-ALSAControl::ALSAControl(const char *device)
+// ----------------------------------------------------------------------------
+
+//
+// A control element resolved by name.  The element id carries the numid, so
+// once an element is cached every read or write is a single ioctl.
+//
+struct ctl_elem_t
 {
-    snd_ctl_open(&mHandle, device, 0);
+    ctl_elem_t() :
+        id(0),
+        type(SND_CTL_ELEM_TYPE_NONE),
+        count(0),
+        min(0),
+        max(0)
+    {
+    }
+
+    ~ctl_elem_t()
+    {
+        if (id) snd_ctl_elem_id_free(id);
+    }
+
+    snd_ctl_elem_id_t *     id;
+    snd_ctl_elem_type_t     type;
+    unsigned int            count;
+    long                    min;
+    long                    max;
+    Vector<String8>         items;      // enumerated item names
+};
+
+ALSAControl::ALSAControl(const char *device) :
+    mCallback(0),
+    mCookie(0)
+{
+    if (snd_ctl_open(&mHandle, device, 0) < 0) {
+        mHandle = NULL;
+        return;
+    }
+
+    // Element removal invalidates the cached numids.
+    snd_ctl_subscribe_events(mHandle, 1);
 }
 
 ALSAControl::~ALSAControl()
 {
+    flush();
     if (mHandle) snd_ctl_close(mHandle);
 }
 
-#ifdef AUDIO_MODEM_TI
-status_t ALSAControl::getmin(const char *name, unsigned int &min)
+void ALSAControl::flush()
 {
-    if (!mHandle) {
-        LOGE("Control not initialized");
-        return NO_INIT;
-    }
+    for (size_t i = 0; i < mElems.size(); i++)
+        delete mElems.valueAt(i);
+    mElems.clear();
+}
+
+ctl_elem_t *ALSAControl::lookup(const char *name)
+{
+    ssize_t index = mElems.indexOfKey(String8(name));
+    if (index >= 0) return mElems.valueAt(index);
 
     snd_ctl_elem_id_t *id;
     snd_ctl_elem_info_t *info;
@@ -65,40 +110,181 @@ status_t ALSAControl::getmin(const char *name, unsigned int &min)
     snd_ctl_elem_info_set_id(info, id);
 
     int ret = snd_ctl_elem_info(mHandle, info);
+    if (ret < 0) {
+        // Jack controls are card controls rather than mixer ones.
+        snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_CARD);
+        snd_ctl_elem_info_set_id(info, id);
+        ret = snd_ctl_elem_info(mHandle, info);
+    }
     if (ret < 0) {
         LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
+        return NULL;
     }
 
-    min = snd_ctl_elem_info_get_min(info);
+    ctl_elem_t *elem = new ctl_elem_t;
+
+    if (snd_ctl_elem_id_malloc(&elem->id) < 0) {
+        delete elem;
+        return NULL;
+    }
+
+    snd_ctl_elem_info_get_id(info, elem->id);
+    elem->type = snd_ctl_elem_info_get_type(info);
+    elem->count = snd_ctl_elem_info_get_count(info);
+
+    if (elem->type == SND_CTL_ELEM_TYPE_INTEGER ||
+        elem->type == SND_CTL_ELEM_TYPE_INTEGER64) {
+        elem->min = snd_ctl_elem_info_get_min(info);
+        elem->max = snd_ctl_elem_info_get_max(info);
+    }
+
+    if (elem->type == SND_CTL_ELEM_TYPE_ENUMERATED) {
+        int items = snd_ctl_elem_info_get_items(info);
+        for (int i = 0; i < items; i++) {
+            snd_ctl_elem_info_set_item(info, i);
+            // Keep the table indexed by item even if one cannot be named.
+            if (snd_ctl_elem_info(mHandle, info) < 0)
+                elem->items.add(String8());
+            else
+                elem->items.add(String8(snd_ctl_elem_info_get_item_name(info)));
+        }
+    }
+
+    mElems.add(String8(name), elem);
+
+    return elem;
+}
+
+void ALSAControl::invalidate(const char *name)
+{
+    ssize_t index = mElems.indexOfKey(String8(name));
+    if (index < 0) return;
+
+    delete mElems.valueAt(index);
+    mElems.removeItemsAt(index);
+}
+
+void ALSAControl::setEventCallback(ctl_event_callback_t callback, void *cookie)
+{
+    AutoMutex lock(mLock);
+
+    mCallback = callback;
+    mCookie = cookie;
+}
+
+int ALSAControl::pollDescriptors(struct pollfd *pfds, unsigned int space)
+{
+    if (!mHandle) return 0;
+
+    return snd_ctl_poll_descriptors(mHandle, pfds, space);
+}
+
+status_t ALSAControl::handleEvents()
+{
+    Vector<ctl_event_info_t> events;
+    ctl_event_callback_t callback;
+    void *cookie;
+    status_t err;
+
+    {
+        AutoMutex lock(mLock);
+
+        err = processEvents();
+
+        events = mPending;
+        mPending.clear();
+        callback = mCallback;
+        cookie = mCookie;
+    }
+
+    // Listeners are called without the lock held so that they can use
+    // this control handle.
+    if (callback)
+        for (size_t i = 0; i < events.size(); i++)
+            callback(cookie, events[i].name.string(), events[i].mask);
+
+    return err;
+}
+
+status_t ALSAControl::processEvents()
+{
+    if (!mHandle) return NO_INIT;
+
+    snd_ctl_event_t *event;
+    snd_ctl_event_alloca(&event);
+
+    snd_ctl_nonblock(mHandle, 1);
+
+    while (snd_ctl_read(mHandle, event) > 0) {
+        if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+            continue;
+
+        unsigned int mask = snd_ctl_event_elem_get_mask(event);
+        if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+            LOGV("Control '%s' removed", snd_ctl_event_elem_get_name(event));
+            invalidate(snd_ctl_event_elem_get_name(event));
+        }
+
+        // Queued for handleEvents(), which may not be our caller.
+        if (mCallback) {
+            ctl_event_info_t info;
+            info.name = snd_ctl_event_elem_get_name(event);
+            info.mask = mask;
+            mPending.add(info);
+        }
+    }
+
+    snd_ctl_nonblock(mHandle, 0);
 
     return NO_ERROR;
 }
 
-status_t ALSAControl::getmax(const char *name, unsigned int &max)
+//
+// Called when an access through a cached element fails.  The numid may have
+// gone stale, so pending removals are processed and the element is resolved
+// once more before giving up.
+//
+ctl_elem_t *ALSAControl::retry(const char *name, int err)
 {
+    LOGV("Control '%s' access failed (%d), resolving again", name, err);
+
+    processEvents();
+    invalidate(name);
+
+    return lookup(name);
+}
+
+#ifdef AUDIO_MODEM_TI
+status_t ALSAControl::getmin(const char *name, unsigned int &min)
+{
+    AutoMutex lock(mLock);
+
     if (!mHandle) {
         LOGE("Control not initialized");
         return NO_INIT;
     }
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
+    ctl_elem_t *elem = lookup(name);
+    if (!elem) return BAD_VALUE;
 
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
+    min = elem->min;
 
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+    return NO_ERROR;
+}
 
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
+status_t ALSAControl::getmax(const char *name, unsigned int &max)
+{
+    AutoMutex lock(mLock);
+
+    if (!mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
     }
 
-    max = snd_ctl_elem_info_get_max(info);
+    ctl_elem_t *elem = lookup(name);
+    if (!elem) return BAD_VALUE;
+
+    max = elem->max;
 
     return NO_ERROR;
 }
@@ -106,46 +292,38 @@ status_t ALSAControl::getmax(const char *name, unsigned int &max)
 
 status_t ALSAControl::get(const char *name, unsigned int &value, int index)
 {
+    AutoMutex lock(mLock);
+
     if (!mHandle) {
         LOGE("Control not initialized");
         return NO_INIT;
     }
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
-    snd_ctl_elem_value_t *control;
-
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
-    snd_ctl_elem_value_alloca(&control);
-
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+    ctl_elem_t *elem = lookup(name);
+    if (!elem) return BAD_VALUE;
 
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
-    }
-
-    int count = snd_ctl_elem_info_get_count(info);
+    int count = elem->count;
     if (index >= count) {
         LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
         return BAD_VALUE;
     }
 
-    snd_ctl_elem_info_get_id(info, id);
-    snd_ctl_elem_value_set_id(control, id);
+    snd_ctl_elem_value_t *control;
+    snd_ctl_elem_value_alloca(&control);
+
+    snd_ctl_elem_value_set_id(control, elem->id);
 
-    ret = snd_ctl_elem_read(mHandle, control);
+    int ret = snd_ctl_elem_read(mHandle, control);
+    if (ret < 0 && (elem = retry(name, ret)) != NULL) {
+        snd_ctl_elem_value_set_id(control, elem->id);
+        ret = snd_ctl_elem_read(mHandle, control);
+    }
     if (ret < 0) {
         LOGE("Control '%s' cannot read element value: %d", name, ret);
         return BAD_VALUE;
     }
 
-    snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
-    switch (type) {
+    switch (elem->type) {
         case SND_CTL_ELEM_TYPE_BOOLEAN:
             value = snd_ctl_elem_value_get_boolean(control, index);
             break;
@@ -168,50 +346,20 @@ status_t ALSAControl::get(const char *name, unsigned int &value, int index)
     return NO_ERROR;
 }
 
-status_t ALSAControl::set(const char *name, unsigned int value, int index)
+static void fillValue(snd_ctl_elem_value_t *control, ctl_elem_t *elem,
+                      unsigned int value, int index)
 {
-    if (!mHandle) {
-        LOGE("Control not initialized");
-        return NO_INIT;
-    }
-
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
-
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
-
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
-
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
-    }
-
-    int count = snd_ctl_elem_info_get_count(info);
-    if (index >= count) {
-        LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
-        return BAD_VALUE;
-    }
+    int count = elem->count;
 
     if (index == -1)
         index = 0; // Range over all of them
     else
         count = index + 1; // Just do the one specified
 
-    snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
-
-    snd_ctl_elem_value_t *control;
-    snd_ctl_elem_value_alloca(&control);
-
-    snd_ctl_elem_info_get_id(info, id);
-    snd_ctl_elem_value_set_id(control, id);
+    snd_ctl_elem_value_set_id(control, elem->id);
 
     for (int i = index; i < count; i++)
-        switch (type) {
+        switch (elem->type) {
             case SND_CTL_ELEM_TYPE_BOOLEAN:
                 snd_ctl_elem_value_set_boolean(control, i, value);
                 break;
@@ -230,46 +378,291 @@ status_t ALSAControl::set(const char *name, unsigned int value, int index)
             default:
                 break;
         }
+}
 
-    ret = snd_ctl_elem_write(mHandle, control);
-    return (ret < 0) ? BAD_VALUE : NO_ERROR;
+status_t ALSAControl::set(const char *name, unsigned int value, int index)
+{
+    AutoMutex lock(mLock);
+
+    return write(name, value, index);
 }
 
-status_t ALSAControl::set(const char *name, const char *value)
+status_t ALSAControl::write(const char *name, unsigned int value, int index)
 {
     if (!mHandle) {
         LOGE("Control not initialized");
         return NO_INIT;
     }
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
+    ctl_elem_t *elem = lookup(name);
+    if (!elem) return BAD_VALUE;
 
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
+    int count = elem->count;
+    if (index >= count) {
+        LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
+        return BAD_VALUE;
+    }
 
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+    snd_ctl_elem_value_t *control;
+    snd_ctl_elem_value_alloca(&control);
 
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
+    fillValue(control, elem, value, index);
+
+    int ret = snd_ctl_elem_write(mHandle, control);
+    if (ret < 0 && (elem = retry(name, ret)) != NULL) {
+        fillValue(control, elem, value, index);
+        ret = snd_ctl_elem_write(mHandle, control);
     }
 
-    int items = snd_ctl_elem_info_get_items(info);
-    for (int i = 0; i < items; i++) {
-        snd_ctl_elem_info_set_item(info, i);
-        ret = snd_ctl_elem_info(mHandle, info);
-        if (ret < 0) continue;
-        if (strcmp(value, snd_ctl_elem_info_get_item_name(info)) == 0)
-            return set(name, i, -1);
+    return (ret < 0) ? BAD_VALUE : NO_ERROR;
+}
+
+status_t ALSAControl::set(const char *name, const char *value)
+{
+    AutoMutex lock(mLock);
+
+    if (!mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
     }
 
+    ctl_elem_t *elem = lookup(name);
+    if (!elem) return BAD_VALUE;
+
+    for (size_t i = 0; i < elem->items.size(); i++)
+        if (strcmp(value, elem->items[i].string()) == 0)
+            return write(name, i, -1);
+
     LOGE("Control '%s' has no enumerated value of '%s'", name, value);
 
     return BAD_VALUE;
 }
 
+// ----------------------------------------------------------------------------
+
+struct ctl_write_t
+{
+    String8                 name;
+    String8                 item;       // enumerated item, if set by name
+    unsigned int            value;
+    int                     index;
+    int                     order;
+
+    // Filled in by commit()
+    ctl_elem_t *            elem;
+    snd_ctl_elem_value_t *  control;
+    snd_ctl_elem_value_t *  saved;
+};
+
+ALSAControl::Transaction::Transaction(ALSAControl *control, bool rollback) :
+    mControl(control),
+    mRollback(rollback),
+    mElapsed(0)
+{
+}
+
+ALSAControl::Transaction::~Transaction()
+{
+    for (size_t i = 0; i < mWrites.size(); i++)
+        delete mWrites[i];
+}
+
+ctl_write_t *ALSAControl::Transaction::entry(const char *name, int index, int order)
+{
+    ctl_write_t *w = NULL;
+
+    // A later write replaces the earlier ones to the same value, and one to
+    // every index (-1) those to single indices; it takes their place in
+    // the order anew. A single index written after every index is written
+    // after it, whatever its order.
+    for (size_t i = 0; i < mWrites.size(); ) {
+        ctl_write_t *e = mWrites[i];
+
+        if (strcmp(e->name.string(), name) != 0) {
+            i++;
+            continue;
+        }
+
+        if (e->index == index || index == -1) {
+            mWrites.removeAt(i);
+            if (w) delete e; else w = e;
+            continue;
+        }
+
+        if (e->index == -1 && e->order > order) order = e->order;
+        i++;
+    }
+
+    if (!w) {
+        w = new ctl_write_t;
+
+        w->name = name;
+        w->value = 0;
+        w->elem = NULL;
+        w->control = NULL;
+        w->saved = NULL;
+    }
+
+    w->index = index;
+    w->order = order;
+
+    // Keep the list sorted by order, stable for equal orders.
+    size_t pos = mWrites.size();
+    while (pos > 0 && mWrites[pos - 1]->order > order) pos--;
+    mWrites.insertAt(w, pos);
+
+    return w;
+}
+
+status_t ALSAControl::Transaction::add(const char *name, unsigned int value,
+                                       int index, int order)
+{
+    ctl_write_t *w = entry(name, index, order);
+
+    w->value = value;
+    w->item = "";
+
+    return NO_ERROR;
+}
+
+status_t ALSAControl::Transaction::add(const char *name, const char *value, int order)
+{
+    ctl_write_t *w = entry(name, -1, order);
+
+    w->value = 0;
+    w->item = value;
+
+    return NO_ERROR;
+}
+
+//
+// An access through the cached element of 'w' failed: resolve it once
+// more, as single accesses do, and point the values of every write to it
+// resolved so far at the result. Called with the control lock held.
+//
+bool ALSAControl::Transaction::refresh(ctl_write_t *w, int err)
+{
+    ctl_elem_t *elem = mControl->retry(w->name.string(), err);
+
+    if (!elem || (int)elem->count <= w->index) return false;
+
+    for (size_t i = 0; i < mWrites.size(); i++) {
+        ctl_write_t *e = mWrites[i];
+
+        if (!e->control || e->name != w->name || (int)elem->count <= e->index) continue;
+
+        e->elem = elem;
+        fillValue(e->control, elem, e->value, e->index);
+        if (e->saved) snd_ctl_elem_value_set_id(e->saved, elem->id);
+    }
+
+    return true;
+}
+
+status_t ALSAControl::Transaction::commit(nsecs_t *elapsed)
+{
+    if (!mControl) return NO_INIT;
+
+    AutoMutex lock(mControl->mLock);
+
+    if (!mControl->mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
+    }
+
+    nsecs_t start = systemTime();
+    status_t err = NO_ERROR;
+    size_t applied = 0;
+    size_t n = mWrites.size();
+
+    // Resolve every element before touching the hardware, so that a bad
+    // name fails the transaction without any side effect.
+    for (size_t i = 0; i < n && err == NO_ERROR; i++) {
+        ctl_write_t *w = mWrites[i];
+
+        w->elem = mControl->lookup(w->name.string());
+        if (!w->elem) {
+            err = BAD_VALUE;
+            break;
+        }
+
+        if ((int)w->elem->count <= w->index) {
+            LOGE("Control '%s' index is out of range (%d >= %d)",
+                 w->name.string(), w->index, w->elem->count);
+            err = BAD_VALUE;
+            break;
+        }
+
+        if (w->item.length()) {
+            size_t item = 0;
+            while (item < w->elem->items.size() && w->elem->items[item] != w->item)
+                item++;
+            if (item == w->elem->items.size()) {
+                LOGE("Control '%s' has no enumerated value of '%s'",
+                     w->name.string(), w->item.string());
+                err = BAD_VALUE;
+                break;
+            }
+            w->value = item;
+        }
+
+        if (snd_ctl_elem_value_malloc(&w->control) < 0 ||
+            (mRollback && snd_ctl_elem_value_malloc(&w->saved) < 0)) {
+            err = NO_MEMORY;
+            break;
+        }
+
+        fillValue(w->control, w->elem, w->value, w->index);
+
+        if (mRollback) {
+            snd_ctl_elem_value_set_id(w->saved, w->elem->id);
+
+            int ret = snd_ctl_elem_read(mControl->mHandle, w->saved);
+            if (ret < 0 && refresh(w, ret))
+                ret = snd_ctl_elem_read(mControl->mHandle, w->saved);
+
+            if (ret < 0) {
+                LOGE("Control '%s' cannot read element value", w->name.string());
+                err = BAD_VALUE;
+                break;
+            }
+        }
+    }
+
+    for (; err == NO_ERROR && applied < n; applied++) {
+        ctl_write_t *w = mWrites[applied];
+
+        int ret = snd_ctl_elem_write(mControl->mHandle, w->control);
+        if (ret < 0 && refresh(w, ret))
+            ret = snd_ctl_elem_write(mControl->mHandle, w->control);
+
+        if (ret < 0) {
+            LOGE("Control '%s' write failed, %s", w->name.string(),
+                 mRollback ? "rolling back" : "transaction left partial");
+            err = BAD_VALUE;
+            break;
+        }
+    }
+
+    if (err != NO_ERROR && mRollback)
+        while (applied-- > 0)
+            snd_ctl_elem_write(mControl->mHandle, mWrites[applied]->saved);
+
+    for (size_t i = 0; i < n; i++) {
+        ctl_write_t *w = mWrites[i];
+        if (w->control) snd_ctl_elem_value_free(w->control);
+        if (w->saved) snd_ctl_elem_value_free(w->saved);
+        w->control = w->saved = NULL;
+        w->elem = NULL;
+    }
+
+    mElapsed = systemTime() - start;
+    if (elapsed) *elapsed = mElapsed;
+
+    LOGV("Control transaction of %d writes %s in %lld us", (int)n,
+         err == NO_ERROR ? "applied" : "failed", ns2us(mElapsed));
+
+    return err;
+}
+
 };        // namespace android
@@ -22,11 +22,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <math.h>
+#include <poll.h>
 
 #define LOG_TAG "AudioHardwareALSA"
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -84,7 +88,12 @@ struct mixer_info_t
         elem(0),
         min(SND_MIXER_VOL_RANGE_MIN),
         max(SND_MIXER_VOL_RANGE_MAX),
-        mute(false)
+        mute(false),
+        applied(0),
+        pending(false),
+        joined(false),
+        hasSwitch(false),
+        channels(0)
     {
     }
 
@@ -93,7 +102,21 @@ struct mixer_info_t
     long              max;
     long              volume;
     bool              mute;
-    char              name[ALSA_NAME_MAX];
+
+    // Written by the volume worker: the raw value last sent to the element,
+    // and whether volume has not reached it yet.
+    long              applied;
+    bool              pending;
+
+    // Element capabilities, resolved once when the element is bound.
+    bool              joined;       // all channels share one volume
+    bool              hasSwitch;    // element has a mute switch
+    uint32_t          channels;     // bit n set if channel n is present
+
+    // dB curve, empty if the element does not describe its dB scale
+    volume_curve_t    curve;
+
+    char              name[PROPERTY_VALUE_MAX];
 };
 
 #ifdef AUDIO_MODEM_TI
@@ -196,186 +219,755 @@ static const setVolume_t setVol[] = {
     snd_mixer_selem_set_capture_volume_all
 };
 
-ALSAMixer::ALSAMixer()
-{
-    int err;
+typedef int (*getVolume_t)(snd_mixer_elem_t*, snd_mixer_selem_channel_id_t, long int*);
 
-    initMixer (&mMixer[SND_PCM_STREAM_PLAYBACK], "AndroidPlayback");
-    initMixer (&mMixer[SND_PCM_STREAM_CAPTURE], "AndroidCapture");
+static const getVolume_t getVol[] = {
+    snd_mixer_selem_get_playback_volume,
+    snd_mixer_selem_get_capture_volume
+};
 
-    snd_mixer_selem_id_t *sid;
-    snd_mixer_selem_id_alloca(&sid);
+typedef int (*getSwitch_t)(snd_mixer_elem_t*, snd_mixer_selem_channel_id_t, int*);
 
-    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+static const getSwitch_t getSwitch[] = {
+    snd_mixer_selem_get_playback_switch,
+    snd_mixer_selem_get_capture_switch
+};
 
-        mixer_info_t *info = mixerMasterProp[i].mInfo = new mixer_info_t;
+typedef int (*getDBRange_t)(snd_mixer_elem_t*, long int*, long int*);
 
-        property_get (mixerMasterProp[i].propName,
-                      info->name,
-                      mixerMasterProp[i].propDefault);
+static const getDBRange_t getDBRange[] = {
+    snd_mixer_selem_get_playback_dB_range,
+    snd_mixer_selem_get_capture_dB_range
+};
+
+typedef int (*askDBVol_t)(snd_mixer_elem_t*, long int, int, long int*);
+
+static const askDBVol_t askDBVol[] = {
+    snd_mixer_selem_ask_playback_dB_vol,
+    snd_mixer_selem_ask_capture_dB_vol
+};
+
+typedef int (*askVolDB_t)(snd_mixer_elem_t*, long int, long int*);
+
+static const askVolDB_t askVolDB[] = {
+    snd_mixer_selem_ask_playback_vol_dB,
+    snd_mixer_selem_ask_capture_vol_dB
+};
+
+typedef int (*hasSwitch_t)(snd_mixer_elem_t*);
+
+static const hasSwitch_t hasSwitch[] = {
+    snd_mixer_selem_has_playback_switch,
+    snd_mixer_selem_has_capture_switch
+};
+
+typedef int (*hasVolumeJoined_t)(snd_mixer_elem_t*);
+
+static const hasVolumeJoined_t hasVolumeJoined[] = {
+    snd_mixer_selem_has_playback_volume_joined,
+    snd_mixer_selem_has_capture_volume_joined
+};
+
+typedef int (*hasChannel_t)(snd_mixer_elem_t*, snd_mixer_selem_channel_id_t);
+
+static const hasChannel_t hasChannel[] = {
+    snd_mixer_selem_has_playback_channel,
+    snd_mixer_selem_has_capture_channel
+};
+
+// ----------------------------------------------------------------------------
+
+//
+// Open addressed hash of the active volume elements of one mixer, keyed by
+// element name.  It is built in a single pass over the mixer so that every
+// property lookup afterwards is O(1) instead of a scan of all elements.
+//
+class MixerIndex
+{
+public:
+    MixerIndex(snd_mixer_t *mixer, int direction) :
+        mSlots(0),
+        mMask(0)
+    {
+        size_t count = mixer ? snd_mixer_get_count(mixer) : 0;
+        size_t size = 8;
 
-        for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mMixer[i]);
+        while (size < count * 2) size <<= 1;
+
+        mSlots = new slot_t[size];
+        memset(mSlots, 0, size * sizeof(slot_t));
+        mMask = size - 1;
+
+        if (!mixer) return;
+
+        for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mixer);
              elem;
              elem = snd_mixer_elem_next(elem)) {
 
-            if (!snd_mixer_selem_is_active(elem))
+            if (!snd_mixer_selem_is_active(elem) || !hasVolume[direction] (elem))
                 continue;
 
-            snd_mixer_selem_get_id(elem, sid);
+            const char *name = snd_mixer_selem_get_name(elem);
+            uint32_t hash = hashName(name);
+
+            // The first element with a given name wins, as the old linear
+            // scan did.
+            size_t i = hash & mMask;
+            while (mSlots[i].elem) {
+                if (mSlots[i].hash == hash &&
+                    strcmp(snd_mixer_selem_get_name(mSlots[i].elem), name) == 0)
+                    break;
+                i = (i + 1) & mMask;
+            }
+
+            if (!mSlots[i].elem) {
+                mSlots[i].hash = hash;
+                mSlots[i].elem = elem;
+            }
+        }
+    }
+
+    ~MixerIndex()
+    {
+        delete[] mSlots;
+    }
+
+    snd_mixer_elem_t *find(const char *name) const
+    {
+        if (!name || !*name) return NULL;
+
+        uint32_t hash = hashName(name);
+
+        for (size_t i = hash & mMask; mSlots[i].elem; i = (i + 1) & mMask)
+            if (mSlots[i].hash == hash &&
+                strcmp(snd_mixer_selem_get_name(mSlots[i].elem), name) == 0)
+                return mSlots[i].elem;
+
+        return NULL;
+    }
+
+private:
+    struct slot_t {
+        uint32_t          hash;
+        snd_mixer_elem_t *elem;
+    };
+
+    // FNV-1a
+    static uint32_t hashName(const char *name)
+    {
+        uint32_t hash = 2166136261u;
+        while (*name) {
+            hash ^= (unsigned char)*name++;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    slot_t *                mSlots;
+    size_t                  mMask;
+};
+
+// ----------------------------------------------------------------------------
+
+volume_curve_t::volume_curve_t() :
+    dBMin(0),
+    dBMax(0),
+    count(0),
+    raw(0),
+    dB(0)
+{
+}
+
+volume_curve_t::~volume_curve_t()
+{
+    delete[] raw;
+    delete[] dB;
+}
+
+//
+// Volumes handed to the HAL are linear amplitudes.  The table is indexed
+// by target attenuation in VOLUME_CURVE_STEP units and holds, for each
+// entry, the raw step closest to it and the attenuation that step really
+// gives, so a software stage can make up the difference.
+//
+long volume_curve_t::lookup(float volume, float *residual) const
+{
+    if (residual) *residual = 1.0f;
+    if (!count) return 0;
+
+    if (volume <= 0.0f) {
+        // Silence: the bottom of the range, and nothing left in software.
+        if (residual) *residual = 0.0f;
+        return raw[0];
+    }
+
+    // Full scale maps to the top of the element.
+    long target = dBMax + (volume >= 1.0f ? 0 : (long)(2000.0f * log10f(volume)));
+
+    int i = (target - dBMin + VOLUME_CURVE_STEP / 2) / VOLUME_CURVE_STEP;
+    if (i < 0) i = 0;
+    if (i >= count) i = count - 1;
+
+    if (residual)
+        *residual = powf(10.0f, (float)(target - dB[i]) / 2000.0f);
+
+    return raw[i];
+}
+
+static void buildCurve(mixer_info_t *info, int direction)
+{
+    volume_curve_t *curve = &info->curve;
+    long dBMin, dBMax;
+
+    if (getDBRange[direction] (info->elem, &dBMin, &dBMax) < 0 || dBMin >= dBMax)
+        return;
+
+    // A mute step reports a huge attenuation; start at the first real one.
+    if (dBMin <= SND_CTL_TLV_DB_GAIN_MUTE) {
+        long raw = info->min + 1;
+        if (raw > info->max || askVolDB[direction] (info->elem, raw, &dBMin) < 0)
+            return;
+    }
+
+    int count = (dBMax - dBMin) / VOLUME_CURVE_STEP + 1;
+
+    curve->raw = new long[count];
+    curve->dB = new long[count];
+    curve->dBMin = dBMin;
+    curve->dBMax = dBMax;
+    curve->count = count;
 
-            // Find PCM playback volume control element.
-            const char *elementName = snd_mixer_selem_id_get_name(sid);
+    for (int i = 0; i < count; i++) {
+        long target = dBMin + i * VOLUME_CURVE_STEP;
+        long raw = info->min, real = target;
+        bool found = false;
 
-            if (info->elem == NULL &&
-                strcmp(elementName, info->name) == 0 &&
-                hasVolume[i] (elem)) {
+        // The step nearest the target, from below or above; a software
+        // stage attenuates whatever it gives over the target.
+        for (int dir = -1; dir <= 1; dir += 2) {
+            long r, d;
 
-                info->elem = elem;
-                getVolumeRange[i] (elem, &info->min, &info->max);
-                info->volume = info->max;
-                setVol[i] (elem, info->volume);
-                if (i == SND_PCM_STREAM_PLAYBACK &&
-                    snd_mixer_selem_has_playback_switch (elem))
-                    snd_mixer_selem_set_playback_switch_all (elem, 1);
-                break;
+            if (askDBVol[direction] (info->elem, target, dir, &r) < 0 ||
+                askVolDB[direction] (info->elem, r, &d) < 0)
+                continue;
+
+            if (!found || labs(d - target) < labs(real - target)) {
+                raw = r;
+                real = d;
+                found = true;
             }
         }
 
+        curve->raw[i] = raw;
+        curve->dB[i] = real;
+    }
+
+    LOGV("Mixer: '%s' dB curve %ld..%ld (%d entries)",
+         info->name, dBMin, dBMax, count);
+}
+
+static long volumeToRaw(mixer_info_t *info, float volume)
+{
+    long vol;
+
+    if (volume <= 0.0f) {
+        vol = info->min;
+    } else if (info->curve.count) {
+        vol = info->curve.lookup(volume, NULL);
+    } else {
+        // No dB information: spread the volume linearly over the range.
+        vol = info->min + volume * (info->max - info->min);
+    }
+
+    // Make sure volume is between bounds.
+    if (vol > info->max) vol = info->max;
+    if (vol < info->min) vol = info->min;
+
+    return vol;
+}
+
+static void bindElement(mixer_info_t *info, snd_mixer_elem_t *elem, int direction,
+                        ALSAMixer *mixer)
+{
+    info->elem = elem;
+    if (!elem) return;
+
+    snd_mixer_elem_set_callback_private(elem, mixer);
+
+    getVolumeRange[direction] (elem, &info->min, &info->max);
+
+    info->joined = hasVolumeJoined[direction] (elem);
+    info->hasSwitch = hasSwitch[direction] (elem);
+    info->channels = 0;
+    for (int chan = SND_MIXER_SCHN_FRONT_LEFT; chan <= SND_MIXER_SCHN_LAST; chan++)
+        if (hasChannel[direction] (elem, (snd_mixer_selem_channel_id_t)chan))
+            info->channels |= 1u << chan;
+
+    buildCurve(info, direction);
+
+    info->volume = info->applied = info->max;
+    setVol[direction] (elem, info->volume);
+    if (direction == SND_PCM_STREAM_PLAYBACK && info->hasSwitch)
+        snd_mixer_selem_set_playback_switch_all (elem, 1);
+}
+
+ALSAMixer::ALSAMixer(ALSAControl *control) :
+    mControl(control),
+    mWakePending(0),
+    mNextVolumeUpdate(0),
+    mJackCallback(0),
+    mJackCookie(0)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("alsa.mixer.volume.interval", value, "10");
+    mVolumeInterval = ms2ns(atoi(value));
+
+    property_get("alsa.mixer.volume.ramp", value, "0");
+    mVolumeRampStep = atoi(value);
+
+    initMixer (&mMixer[SND_PCM_STREAM_PLAYBACK], "AndroidPlayback");
+    initMixer (&mMixer[SND_PCM_STREAM_CAPTURE], "AndroidCapture");
+
+    int routes = 0;
+    while (mixerProp[routes][SND_PCM_STREAM_PLAYBACK].device) routes++;
+
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+
+        MixerIndex index(mMixer[i], i);
+
+        // The master element lives in slot 0, the routes follow it.
+        mInfo[i] = new mixer_info_t[routes + 1];
+
+        mixer_info_t *info = mixerMasterProp[i].mInfo = &mInfo[i][0];
+
+        property_get (mixerMasterProp[i].propName,
+                      info->name,
+                      mixerMasterProp[i].propDefault);
+
+        bindElement(info, index.find(info->name), i, this);
+
         LOGV("Mixer: master '%s' %s.", info->name, info->elem ? "found" : "not found");
 
         for (int j = 0; mixerProp[j][i].device; j++) {
 
-            mixer_info_t *info = mixerProp[j][i].mInfo = new mixer_info_t;
+            mixer_info_t *info = mixerProp[j][i].mInfo = &mInfo[i][j + 1];
 
             property_get (mixerProp[j][i].propName,
                           info->name,
                           mixerProp[j][i].propDefault);
 
-            for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mMixer[i]);
-                 elem;
-                 elem = snd_mixer_elem_next(elem)) {
-
-                if (!snd_mixer_selem_is_active(elem))
-                    continue;
-
-                snd_mixer_selem_get_id(elem, sid);
-
-                // Find PCM playback volume control element.
-                const char *elementName = snd_mixer_selem_id_get_name(sid);
+            bindElement(info, index.find(info->name), i, this);
 
-               if (info->elem == NULL &&
-                    strcmp(elementName, info->name) == 0 &&
-                    hasVolume[i] (elem)) {
-
-                    info->elem = elem;
-                    getVolumeRange[i] (elem, &info->min, &info->max);
-                    info->volume = info->max;
-                    setVol[i] (elem, info->volume);
-                    if (i == SND_PCM_STREAM_PLAYBACK &&
-                        snd_mixer_selem_has_playback_switch (elem))
-                        snd_mixer_selem_set_playback_switch_all (elem, 1);
-                    break;
-                }
-            }
             LOGV("Mixer: route '%s' %s.", info->name, info->elem ? "found" : "not found");
         }
     }
 #ifdef AUDIO_MODEM_TI
-    ALSAControl control("hw:00");
     status_t error;
+
+    int count = 0;
+    while (inCallVolumeProp[count].device) count++;
+    mInCallInfo = new mixer_incall_vol_info_t[count];
+
     for (int i = 0; inCallVolumeProp[i].device; i++) {
-        mixer_incall_vol_info_t *info = inCallVolumeProp[i].mInfo = new mixer_incall_vol_info_t;
+        mixer_incall_vol_info_t *info = inCallVolumeProp[i].mInfo = &mInCallInfo[i];
 
         property_get (inCallVolumeProp[i].propName,
                       info->name,
                       inCallVolumeProp[i].propDefault);
 
-        error = control.get(info->name, info->volume, 0);
-        error = control.getmin(info->name, info->min);
-        error = control.getmax(info->name, info->max);
+        error = mControl->get(info->name, info->volume, 0);
+        error = mControl->getmin(info->name, info->min);
+        error = mControl->getmax(info->name, info->max);
 
         LOGV("Mixer: In Call Volume '%s' %s vol. %d min. %d max. %d",
              info->name, (error < 0) ? "not found" : "found %s vol. %d min. %d max. %d",
              info->volume, info->min, info->max);
     }
 #endif
+
+    startMonitor();
+
     LOGV("mixer initialized.");
 }
 
 ALSAMixer::~ALSAMixer()
 {
+    stopMonitor();
+
     for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
         if (mMixer[i]) snd_mixer_close (mMixer[i]);
-        if (mixerMasterProp[i].mInfo) {
-            delete mixerMasterProp[i].mInfo;
-            mixerMasterProp[i].mInfo = NULL;
+        mixerMasterProp[i].mInfo = NULL;
+        for (int j = 0; mixerProp[j][i].device; j++)
+            mixerProp[j][i].mInfo = NULL;
+        delete[] mInfo[i];
+        mInfo[i] = NULL;
+    }
+#ifdef AUDIO_MODEM_TI
+    for (int i = 0; inCallVolumeProp[i].device; i++)
+        inCallVolumeProp[i].mInfo = NULL;
+    delete[] mInCallInfo;
+    mInCallInfo = NULL;
+#endif
+    LOGV("mixer destroyed.");
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// The monitor thread waits on the mixer and control descriptors and folds
+// every change made by the kernel or by another client into the cached
+// element state, so that the getters never have to go back to the driver.
+//
+class ALSAMixerThread : public Thread
+{
+public:
+    ALSAMixerThread(ALSAMixer *mixer) :
+        Thread(false),
+        mMixer(mixer)
+    {
+    }
+
+private:
+    virtual bool threadLoop()
+    {
+        return mMixer->monitor();
+    }
+
+    ALSAMixer *             mMixer;
+};
+
+#define MONITOR_MAX_FDS 16
+
+void ALSAMixer::startMonitor()
+{
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++)
+        for (snd_mixer_elem_t *elem = mMixer[i] ? snd_mixer_first_elem(mMixer[i]) : NULL;
+             elem;
+             elem = snd_mixer_elem_next(elem))
+            if (snd_mixer_elem_get_callback_private(elem) == this)
+                snd_mixer_elem_set_callback(elem, elemEvent);
+
+    if (mControl) mControl->setEventCallback(controlEvent, this);
+
+    if (pipe(mWakeFd) < 0) {
+        LOGE("Unable to create mixer monitor pipe: %s", strerror(errno));
+        mWakeFd[0] = mWakeFd[1] = -1;
+        return;
+    }
+
+    // Callers must never block on a busy monitor.
+    fcntl(mWakeFd[1], F_SETFL, O_NONBLOCK);
+
+    mThread = new ALSAMixerThread(this);
+    mThread->run("ALSAMixerMonitor", ANDROID_PRIORITY_NORMAL);
+}
+
+void ALSAMixer::stopMonitor()
+{
+    if (mThread != NULL) {
+        mThread->requestExit();
+        wakeMonitor();
+        mThread->requestExitAndWait();
+        mThread.clear();
+    }
+
+    if (mControl) mControl->setEventCallback(NULL, NULL);
+
+    if (mWakeFd[0] >= 0) ::close(mWakeFd[0]);
+    if (mWakeFd[1] >= 0) ::close(mWakeFd[1]);
+    mWakeFd[0] = mWakeFd[1] = -1;
+}
+
+void ALSAMixer::wakeMonitor()
+{
+    char c = 0;
+
+    // One byte in the pipe is enough to wake the thread.
+    if (android_atomic_cmpxchg(0, 1, &mWakePending) == 0 && mWakeFd[1] >= 0)
+        ::write(mWakeFd[1], &c, 1);
+}
+
+bool ALSAMixer::monitor()
+{
+    struct pollfd pfds[MONITOR_MAX_FDS];
+    int first[SND_PCM_STREAM_LAST+1], count[SND_PCM_STREAM_LAST+1];
+    int nfds = 0;
+
+    pfds[nfds].fd = mWakeFd[0];
+    pfds[nfds].events = POLLIN;
+    nfds++;
+
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+        first[i] = nfds;
+        count[i] = mMixer[i] ?
+            snd_mixer_poll_descriptors(mMixer[i], &pfds[nfds], MONITOR_MAX_FDS - nfds) : 0;
+        if (count[i] > 0) nfds += count[i];
+    }
+
+    int control = nfds;
+    if (mControl) nfds += mControl->pollDescriptors(&pfds[nfds], MONITOR_MAX_FDS - nfds);
+
+    int timeout = applyVolumes();
+
+    if (poll(pfds, nfds, timeout) < 0) {
+        if (errno == EINTR) return true;
+        LOGE("Mixer monitor poll failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+        char buf[16];
+        android_atomic_release_store(0, &mWakePending);
+        ::read(mWakeFd[0], buf, sizeof(buf));
+    }
+
+    if (mThread->exitPending()) return false;
+
+    {
+        AutoMutex lock(mLock);
+
+        for (int i = 0; i <= SND_PCM_STREAM_LAST; i++)
+            for (int j = 0; j < count[i]; j++)
+                if (pfds[first[i] + j].revents) {
+                    snd_mixer_handle_events(mMixer[i]);
+                    break;
+                }
+    }
+
+    for (int j = control; j < nfds; j++)
+        if (pfds[j].revents) {
+            mControl->handleEvents();
+            break;
         }
-        for (int j = 0; mixerProp[j][i].device; j++) {
-            if (mixerProp[j][i].mInfo) {
-                delete mixerProp[j][i].mInfo;
-                mixerProp[j][i].mInfo = NULL;
+
+    return true;
+}
+
+//
+// Volume changes are only recorded by the callers; the monitor thread sends
+// them to the hardware.  Intermediate values of a fast series of updates are
+// dropped, elements are written at most once per interval, and with a ramp
+// step configured the element walks to its target in steps of that size.
+// The targets have a lock of their own, mVolumeLock, so that setting a
+// volume never waits for the element writes.
+//
+// Called with mVolumeLock held.
+//
+void ALSAMixer::queueVolume(mixer_info_t *info, long vol)
+{
+    info->volume = vol;
+
+    if (info->applied == vol && !info->pending) return;
+
+    info->pending = true;
+    wakeMonitor();
+}
+
+// Returns the poll timeout until the next volume update is due, -1 if none.
+int ALSAMixer::applyVolumes()
+{
+    struct {
+        snd_mixer_elem_t *  elem;
+        long                vol;
+        int                 direction;
+    } writes[2 * sizeof(mixerProp) / sizeof(mixerProp[0])];
+    int count = 0;
+    bool busy = false;
+
+    AutoMutex lock(mLock);
+
+    {
+        AutoMutex volume(mVolumeLock);
+        nsecs_t now = systemTime();
+
+        if (now < mNextVolumeUpdate)
+            return (int)ns2ms(mNextVolumeUpdate - now + 999999);
+
+        for (int i = 0; i <= SND_PCM_STREAM_LAST; i++)
+            for (int j = 0; mInfo[i] && (j == 0 || mixerProp[j-1][i].device); j++) {
+                mixer_info_t *info = &mInfo[i][j];
+                if (!info->pending || !info->elem) continue;
+
+                // A muted element is written on unmute.
+                if (info->mute && !info->hasSwitch) {
+                    info->pending = false;
+                    continue;
+                }
+
+                long vol = info->volume;
+                if (mVolumeRampStep > 0) {
+                    if (vol > info->applied + mVolumeRampStep)
+                        vol = info->applied + mVolumeRampStep;
+                    else if (vol < info->applied - mVolumeRampStep)
+                        vol = info->applied - mVolumeRampStep;
+                }
+
+                // Several routes may share an element; write it once.
+                if (vol != info->applied) {
+                    writes[count].elem = info->elem;
+                    writes[count].vol = vol;
+                    writes[count].direction = i;
+                    count++;
+                }
+
+                for (int k = 0; k == 0 || mixerProp[k-1][i].device; k++)
+                    if (mInfo[i][k].elem == info->elem) {
+                        mInfo[i][k].applied = vol;
+                        mInfo[i][k].pending = (vol != mInfo[i][k].volume);
+                    }
+
+                busy = busy || info->pending;
+            }
+
+        if (count) mNextVolumeUpdate = now + mVolumeInterval;
+    }
+
+    // Only the monitor thread handles mixer events, so no element can go
+    // away before it is written.
+    for (int n = 0; n < count; n++)
+        setVol[writes[n].direction] (writes[n].elem, writes[n].vol);
+
+    return busy ? (int)ns2ms(mVolumeInterval + 999999) : -1;
+}
+
+//
+// Called from snd_mixer_handle_events() with mLock held.  An element can
+// back several routes, so every record bound to it is refreshed.
+//
+int ALSAMixer::elemEvent(snd_mixer_elem_t *elem, unsigned int mask)
+{
+    ALSAMixer *mixer = static_cast<ALSAMixer *>(snd_mixer_elem_get_callback_private(elem));
+    if (!mixer) return 0;
+
+    AutoMutex volume(mixer->mVolumeLock);
+
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+        for (int j = 0; mixer->mInfo[i] && (j == 0 || mixerProp[j-1][i].device); j++) {
+            mixer_info_t *info = &mixer->mInfo[i][j];
+            if (info->elem != elem) continue;
+
+            if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+                LOGW("Mixer: element '%s' removed", info->name);
+                info->elem = NULL;
+                continue;
+            }
+
+            if (!(mask & SND_CTL_EVENT_MASK_VALUE)) continue;
+
+            snd_mixer_selem_channel_id_t chan = info->channels ?
+                (snd_mixer_selem_channel_id_t)__builtin_ctz(info->channels) :
+                SND_MIXER_SCHN_FRONT_LEFT;
+
+            if (info->hasSwitch) {
+                int on;
+                if (getSwitch[i] (elem, chan, &on) == 0) info->mute = !on;
             }
+
+            // While muted through the volume the hardware reads zero, but
+            // the cached value is what unmuting restores.  While the worker
+            // is still moving the element, the target stays authoritative.
+            long vol;
+            if ((info->hasSwitch || !info->mute) && !info->pending &&
+                getVol[i] (elem, chan, &vol) == 0)
+                info->volume = info->applied = vol;
         }
     }
-    LOGV("mixer destroyed.");
+
+    return 0;
+}
+
+void ALSAMixer::controlEvent(void *cookie, const char *name, unsigned int mask)
+{
+    ALSAMixer *mixer = static_cast<ALSAMixer *>(cookie);
+
+    if (mask == SND_CTL_EVENT_MASK_REMOVE || !(mask & SND_CTL_EVENT_MASK_VALUE))
+        return;
+
+    // Jack detection controls are named "<something> Jack".
+    size_t length = strlen(name);
+    if (length < 5 || strcmp(name + length - 5, " Jack") != 0) return;
+
+    unsigned int value;
+    if (mixer->mControl->get(name, value, 0) != NO_ERROR) return;
+
+    LOGD("Mixer: jack '%s' %s", name, value ? "plugged" : "unplugged");
+
+    jack_callback_t callback;
+    void *jackCookie;
+    {
+        AutoMutex lock(mixer->mLock);
+        callback = mixer->mJackCallback;
+        jackCookie = mixer->mJackCookie;
+    }
+
+    if (callback) callback(jackCookie, name, value != 0);
+}
+
+const volume_curve_t *ALSAMixer::volumeCurve(uint32_t device, int direction)
+{
+    if (direction < 0 || direction > SND_PCM_STREAM_LAST) return NULL;
+
+    if (device == AudioSystem::DEVICE_OUT_ALL)
+        return mixerMasterProp[direction].mInfo ?
+            &mixerMasterProp[direction].mInfo->curve : NULL;
+
+    for (int j = 0; mixerProp[j][direction].device; j++)
+        if ((mixerProp[j][direction].device & device) && mixerProp[j][direction].mInfo)
+            return &mixerProp[j][direction].mInfo->curve;
+
+    return NULL;
+}
+
+void ALSAMixer::setJackCallback(jack_callback_t callback, void *cookie)
+{
+    AutoMutex lock(mLock);
+
+    mJackCallback = callback;
+    mJackCookie = cookie;
 }
 
 status_t ALSAMixer::setMasterVolume(float volume)
 {
+    AutoMutex lock(mVolumeLock);
+
     mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_PLAYBACK].mInfo;
     if (!info || !info->elem) return INVALID_OPERATION;
 
-    long minVol = info->min;
-    long maxVol = info->max;
+    long vol = volumeToRaw(info, volume);
 
-    // Make sure volume is between bounds.
-    long vol = minVol + volume * (maxVol - minVol);
-    if (vol > maxVol) vol = maxVol;
-    if (vol < minVol) vol = minVol;
-
-    info->volume = vol;
-    snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+    queueVolume(info, vol);
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setMasterGain(float gain)
 {
+    AutoMutex lock(mVolumeLock);
+
     mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_CAPTURE].mInfo;
     if (!info || !info->elem) return INVALID_OPERATION;
 
-    long minVol = info->min;
-    long maxVol = info->max;
-
-    // Make sure volume is between bounds.
-    long vol = minVol + gain * (maxVol - minVol);
-    if (vol > maxVol) vol = maxVol;
-    if (vol < minVol) vol = minVol;
+    long vol = volumeToRaw(info, gain);
 
-    info->volume = vol;
-    snd_mixer_selem_set_capture_volume_all (info->elem, vol);
+    queueVolume(info, vol);
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setVolume(uint32_t device, float left, float right)
 {
+    AutoMutex lock(mVolumeLock);
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
 
             mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_PLAYBACK].mInfo;
             if (!info || !info->elem) return INVALID_OPERATION;
 
-            long minVol = info->min;
-            long maxVol = info->max;
-
-            // Make sure volume is between bounds.
-            long vol = minVol + left * (maxVol - minVol);
-            if (vol > maxVol) vol = maxVol;
-            if (vol < minVol) vol = minVol;
+            long vol = volumeToRaw(info, left);
 
-            info->volume = vol;
-            snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+            queueVolume(info, vol);
         }
 
     return NO_ERROR;
@@ -383,22 +975,17 @@ status_t ALSAMixer::setVolume(uint32_t device, float left, float right)
 
 status_t ALSAMixer::setGain(uint32_t device, float gain)
 {
+    AutoMutex lock(mVolumeLock);
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
 
             mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_CAPTURE].mInfo;
             if (!info || !info->elem) return INVALID_OPERATION;
 
-            long minVol = info->min;
-            long maxVol = info->max;
+            long vol = volumeToRaw(info, gain);
 
-            // Make sure volume is between bounds.
-            long vol = minVol + gain * (maxVol - minVol);
-            if (vol > maxVol) vol = maxVol;
-            if (vol < minVol) vol = minVol;
-
-            info->volume = vol;
-            snd_mixer_selem_set_capture_volume_all (info->elem, vol);
+            queueVolume(info, vol);
         }
 
     return NO_ERROR;
@@ -406,13 +993,16 @@ status_t ALSAMixer::setGain(uint32_t device, float gain)
 
 status_t ALSAMixer::setCaptureMuteState(uint32_t device, bool state)
 {
+    AutoMutex lock(mLock);
+    AutoMutex volume(mVolumeLock);
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
 
             mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_CAPTURE].mInfo;
             if (!info || !info->elem) return INVALID_OPERATION;
 
-            if (snd_mixer_selem_has_capture_switch (info->elem)) {
+            if (info->hasSwitch) {
 
                 int err = snd_mixer_selem_set_capture_switch_all (info->elem, static_cast<int>(!state));
                 if (err < 0) {
@@ -421,41 +1011,21 @@ status_t ALSAMixer::setCaptureMuteState(uint32_t device, bool state)
                     return INVALID_OPERATION;
                 }
             } else {
-                //is capture element has volume else return failure
-                if(!snd_mixer_selem_has_capture_volume(info->elem)) {
-                    LOGE("Element: %s doesn't have volume control",info->name);
-                    return INVALID_OPERATION;
+                long vol = state ? 0 : info->volume;
+
+                // The worker does not touch a muted element, and unmuting
+                // lands directly on the latest volume.
+                info->applied = info->volume;
+                info->pending = false;
+
+                //Is all the channels are joined
+                if (info->joined) {
+                    snd_mixer_selem_set_capture_volume_all(info->elem, vol);
                 } else {
-                    //Is all the channels are joined
-                    if(snd_mixer_selem_has_capture_volume_joined(info->elem)) {
-                        //change all channels volume to 0
-                        if (state) {
-                            // muting
-                            snd_mixer_selem_set_capture_volume_all(info->elem, 0);
-                        } else {
-                            //unmuting
-                            snd_mixer_selem_set_capture_volume_all(info->elem, info->volume);
-                        }
-                    } else {
-                        //snd_mixer_selem_channel_id_t chan_id;
-                        for(int chan_id = SND_MIXER_SCHN_FRONT_LEFT;
-                                chan_id <= SND_MIXER_SCHN_LAST;
-                                chan_id++) {
-                            // check channel is present
-                            if(snd_mixer_selem_has_capture_channel(info->elem,
-                                        (snd_mixer_selem_channel_id_t)chan_id)) {
-                                if (state) {
-                                    //make the volume to 0, incase of mute
-                                    snd_mixer_selem_set_capture_volume(info->elem,
-                                            (snd_mixer_selem_channel_id_t)chan_id, 0);
-                                } else {
-                                    //restore the volume incase of unmute
-                                    snd_mixer_selem_set_capture_volume(info->elem,
-                                            (snd_mixer_selem_channel_id_t)chan_id, info->volume);
-                                }
-                            }
-                        }
-                    }
+                    // only visit the channels the element actually has
+                    for (uint32_t mask = info->channels; mask; mask &= mask - 1)
+                        snd_mixer_selem_set_capture_volume(info->elem,
+                                (snd_mixer_selem_channel_id_t)__builtin_ctz(mask), vol);
                 }
             }
             info->mute = state;
@@ -468,6 +1038,8 @@ status_t ALSAMixer::getCaptureMuteState(uint32_t device, bool *state)
 {
     if (!state) return BAD_VALUE;
 
+    AutoMutex lock(mLock);
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
 
@@ -483,13 +1055,16 @@ status_t ALSAMixer::getCaptureMuteState(uint32_t device, bool *state)
 
 status_t ALSAMixer::setPlaybackMuteState(uint32_t device, bool state)
 {
+    AutoMutex lock(mLock);
+    AutoMutex volume(mVolumeLock);
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
 
             mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_PLAYBACK].mInfo;
             if (!info || !info->elem) return INVALID_OPERATION;
 
-            if (snd_mixer_selem_has_playback_switch (info->elem)) {
+            if (info->hasSwitch) {
 
                 int err = snd_mixer_selem_set_playback_switch_all (info->elem, static_cast<int>(!state));
                 if (err < 0) {
@@ -509,6 +1084,8 @@ status_t ALSAMixer::getPlaybackMuteState(uint32_t device, bool *state)
 {
     if (!state) return BAD_VALUE;
 
+    AutoMutex lock(mLock);
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
 
@@ -525,10 +1102,12 @@ status_t ALSAMixer::getPlaybackMuteState(uint32_t device, bool *state)
 #ifdef AUDIO_MODEM_TI
 status_t ALSAMixer::setVoiceVolume(float volume)
 {
+    AutoMutex lock(mLock);
+
     status_t error = NO_ERROR;
     mixer_incall_vol_info_t *info = NULL;
 
-    ALSAControl control("hw:00");
+    ALSAControl::Transaction transaction(mControl);
 
     for (int j = 0; inCallVolumeProp[j].device; j++) {
 
@@ -541,13 +1120,18 @@ status_t ALSAMixer::setVoiceVolume(float volume)
 
         LOGV("%s: in call volume level to apply: %d", info->name, info->volume);
 
-        error = control.set(info->name, info->volume, 0);
-        if (error < 0) {
-            LOGE("%s: error applying in call volume: %d", info->name, info->volume);
-            return error;
-        }
+        transaction.add(info->name, info->volume, 0);
+    }
+
+    nsecs_t elapsed;
+    error = transaction.commit(&elapsed);
+    if (error < 0) {
+        LOGE("error applying in call volume: %d", error);
+        return error;
     }
 
+    LOGV("in call volume applied in %lld us", ns2us(elapsed));
+
     return NO_ERROR;
 
 }
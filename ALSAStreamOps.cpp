@@ -270,7 +270,7 @@ uint32_t ALSAStreamOps::channels() const
 
 void ALSAStreamOps::close()
 {
-    mParent->mALSADevice->close(mHandle);
+    if (mHandle) mParent->mALSADevice->close(mHandle);
 }
 
 //
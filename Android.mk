@@ -23,7 +23,8 @@ ifeq ($(strip $(BOARD_USES_ALSA_AUDIO)),true)
 	AudioStreamInALSA.cpp \
 	ALSAStreamOps.cpp \
 	ALSAMixer.cpp \
-	ALSAControl.cpp
+	ALSAControl.cpp \
+	ALSACapture.cpp
 
   LOCAL_MODULE := libaudio
   LOCAL_MODULE_TAGS := eng
@@ -96,7 +97,8 @@ endif
 
   include $(BUILD_SHARED_LIBRARY)
 
-# This is the default Acoustics module which is essentially a stub
+# This is the default Acoustics module: high-pass filter, echo
+# cancellation, noise suppression and AGC on the capture path
 
   include $(CLEAR_VARS)
 
@@ -104,13 +106,17 @@ endif
 
   LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
-  LOCAL_CFLAGS := -D_POSIX_SOURCE -Wno-multichar
+  LOCAL_CFLAGS := -D_POSIX_SOURCE -Wno-multichar -O2 -ftree-vectorize
 
   LOCAL_C_INCLUDES += external/alsa-lib/include
 
   LOCAL_SRC_FILES:= acoustics_default.cpp
 
-  LOCAL_SHARED_LIBRARIES := liblog
+  LOCAL_SHARED_LIBRARIES := \
+  	libasound \
+  	libcutils \
+  	libutils \
+  	liblog
 
   LOCAL_MODULE:= acoustics.default
   LOCAL_MODULE_TAGS := eng
@@ -75,8 +75,9 @@ AudioHardwareALSA::AudioHardwareALSA() :
     mALSADevice(0),
     mAcousticDevice(0)
 {
+    mCapture = new ALSACapture(this);
     snd_lib_error_set_handler(&ALSAErrorHandler);
-    mMixer = new ALSAMixer;
+    mMixer = new ALSAMixer(control());
 
     hw_module_t *module;
     int err = hw_get_module(ALSA_HARDWARE_MODULE_ID,
@@ -109,12 +110,28 @@ AudioHardwareALSA::AudioHardwareALSA() :
 AudioHardwareALSA::~AudioHardwareALSA()
 {
     if (mMixer) delete mMixer;
+    delete mCapture;
+    for (size_t i = 0; i < mControls.size(); i++)
+        delete mControls.valueAt(i);
     if (mALSADevice)
         mALSADevice->common.close(&mALSADevice->common);
     if (mAcousticDevice)
         mAcousticDevice->common.close(&mAcousticDevice->common);
 }
 
+ALSAControl *AudioHardwareALSA::control(const char *device)
+{
+    AutoMutex lock(mControlLock);
+
+    ssize_t index = mControls.indexOfKey(String8(device));
+    if (index >= 0) return mControls.valueAt(index);
+
+    ALSAControl *control = new ALSAControl(device);
+    mControls.add(String8(device), control);
+
+    return control;
+}
+
 status_t AudioHardwareALSA::initCheck()
 {
     if (mALSADevice && mMixer && mMixer->isValid())
@@ -158,7 +175,11 @@ status_t AudioHardwareALSA::setMode(int mode)
             // take care of mode change.
             for(ALSAHandleList::iterator it = mDeviceList.begin();
                 it != mDeviceList.end(); ++it) {
-                status = mALSADevice->route(&(*it), it->curDev, mode);
+                // An open capture PCM is in use by the capture thread.
+                if ((it->devices & AudioSystem::DEVICE_IN_ALL) && mCapture->clients())
+                    status = mCapture->route(0, mode);
+                else
+                    status = mALSADevice->route(&(*it), it->curDev, mode);
                 if (status != NO_ERROR)
                     break;
             }
@@ -232,9 +253,16 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
     for(ALSAHandleList::iterator it = mDeviceList.begin();
         it != mDeviceList.end(); ++it)
         if (it->devices & devices) {
-            err = mALSADevice->open(&(*it), devices, mode());
+            // The first input opens capture for the configuration it asks
+            // for; later ones share it and are converted by the engine.
+            alsa_handle_t config = *it;
+            if (!mCapture->clients()) {
+                if (sampleRate && *sampleRate) config.sampleRate = *sampleRate;
+                if (channels && *channels) config.channels = AudioSystem::popCount(*channels);
+            }
+            err = mCapture->attach(&config, devices, mode());
             if (err) break;
-            in = new AudioStreamInALSA(this, &(*it), acoustics);
+            in = new AudioStreamInALSA(this, mCapture->handle(), acoustics);
             err = in->set(format, channels, sampleRate);
             break;
         }
@@ -266,25 +294,75 @@ status_t AudioHardwareALSA::getMicMute(bool *state)
     return NO_ERROR;
 }
 
-// non-default implementation
+//
+// The size returned is one hardware capture period expressed at the
+// requested rate and channel count, so that reads of that size never
+// straddle a period.
+//
 size_t AudioHardwareALSA::getInputBufferSize(uint32_t sampleRate, int format, int channelCount)
 {
-    if (!(sampleRate == 8000 ||
-        sampleRate == 16000 ||
-        sampleRate == 11025)) {
-        LOGW("getInputBufferSize bad sampling rate: %d", sampleRate);
-        return 0;
+    switch (sampleRate) {
+        case 8000:
+        case 11025:
+        case 16000:
+        case 22050:
+        case 32000:
+        case 44100:
+        case 48000:
+            break;
+        default:
+            LOGW("getInputBufferSize bad sampling rate: %d", sampleRate);
+            return 0;
     }
-    if (format != AudioSystem::PCM_16_BIT) {
-        LOGW("getInputBufferSize bad format: %d", format);
-        return 0;
+
+    size_t sampleSize;
+    switch (format) {
+        case AudioSystem::PCM_16_BIT:
+            sampleSize = 2;
+            break;
+        case AudioSystem::PCM_8_BIT:
+            sampleSize = 1;
+            break;
+        default:
+            LOGW("getInputBufferSize bad format: %d", format);
+            return 0;
     }
-    if (channelCount != 1) {
+
+    if (channelCount != 1 && channelCount != 2) {
         LOGW("getInputBufferSize bad channel count: %d", channelCount);
         return 0;
     }
 
-    return 320;
+    AutoMutex lock(mLock);
+
+    alsa_handle_t *handle = NULL;
+    for(ALSAHandleList::iterator it = mDeviceList.begin();
+        it != mDeviceList.end(); ++it)
+        if (it->devices & AudioSystem::DEVICE_IN_ALL) {
+            handle = &(*it);
+            break;
+        }
+
+    if (!handle) return 0;
+
+    // Prefer what capture is running with, as recorded when the PCM was
+    // set up; the PCM itself belongs to the capture thread. Before the
+    // first open, a period is a quarter of the requested latency.
+    uint32_t rate;
+    snd_pcm_uframes_t periodSize;
+
+    if (mCapture->getParams(&rate, &periodSize) != NO_ERROR) {
+        rate = handle->sampleRate;
+        periodSize = handle->periodSize;
+    }
+
+    uint64_t frames;
+    if (periodSize && rate)
+        frames = ((uint64_t)periodSize * sampleRate + rate - 1) / rate;
+    else
+        frames = ((uint64_t)handle->latency / 4 * sampleRate + 999999) / 1000000;
+
+    return frames * channelCount * sampleSize;
 }
 
 status_t AudioHardwareALSA::dump(int fd, const Vector<String16>& args)
@@ -19,6 +19,8 @@
 #define ANDROID_AUDIO_HARDWARE_ALSA_H
 
 #include <utils/List.h>
+#include <utils/KeyedVector.h>
+#include <utils/threads.h>
 #include <hardware_legacy/AudioHardwareBase.h>
 
 #include <alsa/asoundlib.h>
@@ -30,6 +32,15 @@ namespace android
 
 class AudioHardwareALSA;
 
+class ALSAControl;
+
+struct mixer_info_t;
+struct ctl_elem_t;
+struct ctl_write_t;
+#ifdef AUDIO_MODEM_TI
+struct mixer_incall_vol_info_t;
+#endif
+
 /**
  * The id of ALSA module
  */
@@ -49,6 +60,7 @@ struct alsa_handle_t {
     uint32_t            sampleRate;
     unsigned int        latency;         // Delay in usec
     unsigned int        bufferSize;      // Size of sample buffer
+    unsigned int        periodSize;      // Size of a period, as configured
     void *              modPrivate;
 };
 
@@ -69,6 +81,23 @@ struct alsa_device_t {
 #define ACOUSTICS_HARDWARE_MODULE_ID    "acoustics"
 #define ACOUSTICS_HARDWARE_NAME         "acoustics"
 
+// Acoustics flag beyond AudioSystem::audio_in_acoustics: echo cancellation
+// against the playback data the module gets through write().
+#define ACOUSTICS_AEC_ENABLE            0x0100
+
+#define ACOUSTICS_MAX_MICS              8
+#define ACOUSTICS_GEOMETRY_TAG          0x47454f4d  // 'GEOM'
+
+// Microphone array geometry, passed to set_params() (and so through
+// AudioStreamInALSA::setAcousticParams()). Microphones are listed in the
+// order of the capture channels.
+struct acoustic_geometry_t {
+    uint32_t            tag;        // ACOUSTICS_GEOMETRY_TAG
+    int                 count;
+    float               position[ACOUSTICS_MAX_MICS][3];    // metres
+    float               look[3];    // unit vector towards the talker
+};
+
 struct acoustic_device_t {
     hw_device_t common;
 
@@ -83,15 +112,61 @@ struct acoustic_device_t {
     ssize_t (*write)(acoustic_device_t *, const void *, size_t);
     status_t (*recover)(acoustic_device_t *, int);
 
+    // Position (in frames since the PCM was opened) and CLOCK_MONOTONIC
+    // time of the first frame of the buffer about to be read or written.
+    void (*timestamp)(acoustic_device_t *, snd_pcm_stream_t, int64_t, nsecs_t);
+
+    // Process captured data in place, for callers that read the PCM
+    // themselves instead of going through read(). It may be called from a
+    // thread of its own, without the capture PCM lock, so it must not
+    // touch the PCM.
+    ssize_t (*process)(acoustic_device_t *, void *, size_t);
+
+    // Voice activity in the capture last read or processed: 1 for speech,
+    // 0 for none, negative if unknown.
+    int (*activity)(acoustic_device_t *);
+
     void *              modPrivate;
 };
 
 // ----------------------------------------------------------------------------
 
+// Volume curve step, in 0.01 dB
+#define VOLUME_CURVE_STEP 50
+
+/**
+ * Maps a linear volume onto the raw steps of one mixer element through the
+ * element's own dB scale. Built once when the element is bound, never
+ * changed afterwards, and shared with software gain stages, which apply
+ * the residual returned by lookup() so that hardware and software gain add
+ * up to the requested volume.
+ */
+struct volume_curve_t {
+    volume_curve_t();
+    ~volume_curve_t();
+
+    long                lookup(float volume, float *residual) const;
+
+    long                dBMin;      // 0.01 dB
+    long                dBMax;
+    int                 count;
+    long *              raw;        // raw step for each VOLUME_CURVE_STEP
+    long *              dB;         // attenuation that step really gives
+
+private:
+    // The tables are owned.
+    volume_curve_t(const volume_curve_t&);
+    volume_curve_t&     operator=(const volume_curve_t&);
+};
+
+typedef void (*jack_callback_t)(void *cookie, const char *name, bool plugged);
+
+class ALSAMixerThread;
+
 class ALSAMixer
 {
 public:
-    ALSAMixer();
+    ALSAMixer(ALSAControl *control);
     virtual                ~ALSAMixer();
 
     bool                    isValid() { return !!mMixer[SND_PCM_STREAM_PLAYBACK]; }
@@ -109,10 +184,54 @@ public:
     status_t                setPlaybackMuteState(uint32_t device, bool state);
     status_t                getPlaybackMuteState(uint32_t device, bool *state);
 
+    // The dB curve of a route (DEVICE_OUT_ALL for the master element), or
+    // NULL. An empty curve means the element has no dB information. Curves
+    // are built with the mixer and stay as they are, so this takes no lock.
+    const volume_curve_t *  volumeCurve(uint32_t device, int direction);
+
+    // Called from the monitor thread when a jack detection control changes.
+    void                    setJackCallback(jack_callback_t callback, void *cookie);
+
 private:
+    friend class ALSAMixerThread;
+
+    void                    startMonitor();
+    void                    stopMonitor();
+    void                    wakeMonitor();
+    bool                    monitor();
+
+    void                    queueVolume(mixer_info_t *info, long vol);
+    int                     applyVolumes();
+
+    static int              elemEvent(snd_mixer_elem_t *elem, unsigned int mask);
+    static void             controlEvent(void *cookie, const char *name, unsigned int mask);
+
     snd_mixer_t *           mMixer[SND_PCM_STREAM_LAST+1];
+    ALSAControl *           mControl;
+
+    Mutex                   mLock;              // the mixers and element state
+    Mutex                   mVolumeLock;        // volume targets, taken inside mLock
+    int                     mWakeFd[2];
+    volatile int32_t        mWakePending;
+    sp<ALSAMixerThread>     mThread;
+
+    nsecs_t                 mVolumeInterval;    // alsa.mixer.volume.interval (ms)
+    long                    mVolumeRampStep;    // alsa.mixer.volume.ramp (raw steps)
+    nsecs_t                 mNextVolumeUpdate;
+
+    jack_callback_t         mJackCallback;
+    void *                  mJackCookie;
+
+    // Resolved elements, one contiguous array per direction: the master
+    // element first, followed by the routes in mixerProp order.
+    mixer_info_t *          mInfo[SND_PCM_STREAM_LAST+1];
+#ifdef AUDIO_MODEM_TI
+    mixer_incall_vol_info_t *mInCallInfo;
+#endif
 };
 
+typedef void (*ctl_event_callback_t)(void *cookie, const char *name, unsigned int mask);
+
 class ALSAControl
 {
 public:
@@ -127,8 +246,233 @@ public:
     status_t                getmin(const char *name, unsigned int &max);
     status_t                getmax(const char *name, unsigned int &min);
 #endif
+
+    // Process pending control events, dropping cached elements that the
+    // kernel has removed and passing every event on to the callback.
+    status_t                handleEvents();
+
+    void                    setEventCallback(ctl_event_callback_t callback, void *cookie);
+    int                     pollDescriptors(struct pollfd *pfds, unsigned int space);
+
+    /**
+     * A set of control writes resolved up front and applied back to back.
+     * Writes are applied in ascending order, then in the order they were
+     * added. If any write fails, the ones already applied are restored to
+     * the values read before the transaction started (when rollback is set).
+     */
+    class Transaction
+    {
+    public:
+        Transaction(ALSAControl *control, bool rollback = true);
+        ~Transaction();
+
+        status_t            add(const char *name, unsigned int value,
+                                int index = -1, int order = 0);
+        status_t            add(const char *name, const char *value, int order = 0);
+
+        // elapsed receives the time spent resolving and applying the writes
+        status_t            commit(nsecs_t *elapsed = 0);
+        nsecs_t             elapsed() const { return mElapsed; }
+
+    private:
+        ctl_write_t *       entry(const char *name, int index, int order);
+        bool                refresh(ctl_write_t *w, int err);
+
+        ALSAControl *       mControl;
+        bool                mRollback;
+        nsecs_t             mElapsed;
+        Vector<ctl_write_t *> mWrites;
+    };
+
 private:
+    friend class Transaction;
+
+    status_t                write(const char *name, unsigned int value, int index);
+    status_t                processEvents();
+    ctl_elem_t *            lookup(const char *name);
+    ctl_elem_t *            retry(const char *name, int err);
+    void                    invalidate(const char *name);
+    void                    flush();
+
     snd_ctl_t *             mHandle;
+
+    // One handle is shared by every user of a card, see
+    // AudioHardwareALSA::control().
+    Mutex                   mLock;
+
+    // Elements resolved by name, valid until the kernel removes them.
+    KeyedVector<String8, ctl_elem_t *> mElems;
+
+    struct ctl_event_info_t {
+        String8             name;
+        unsigned int        mask;
+    };
+
+    ctl_event_callback_t    mCallback;
+    void *                  mCookie;
+    Vector<ctl_event_info_t> mPending;
+};
+
+struct capture_reader_t;
+class AudioStreamOutALSA;
+class ALSACaptureThread;
+class ALSAProcessThread;
+
+// Time spent in one stage of the capture pipeline, per period.
+struct capture_stats_t {
+    uint32_t            count;
+    nsecs_t             total;
+    nsecs_t             max;
+};
+
+/**
+ * Shares the capture PCM between input streams. A single thread reads the
+ * hardware into a ring; every input stream is a reader with its own
+ * position, rate and channel count, and its own count of lost frames.
+ *
+ * In pipelined mode a second thread runs the acoustics module over each
+ * period as soon as it has been read, while the next one is being
+ * captured, and only processed frames are handed to readers.
+ *
+ * In duplex mode the capture PCM is linked to that of an output stream in
+ * callback mode, and the capture thread renders a period of it after
+ * reading one, so the echo path is the same on every call.
+ */
+class ALSACapture
+{
+public:
+    ALSACapture(AudioHardwareALSA *parent);
+    virtual            ~ALSACapture();
+
+    // The first client opens the PCM with its handle, the last one closes
+    // it, unless capture history is kept: capture then goes on for the
+    // next client to take over.
+    status_t            attach(alsa_handle_t *handle, uint32_t devices, int mode);
+    void                detach();
+
+    int                 clients()
+    {
+        return mClients;
+    }
+
+    // The capture PCM, while there are clients.
+    alsa_handle_t *     handle()
+    {
+        return mHandle;
+    }
+
+    // 'devices' 0 keeps the current ones.
+    status_t            route(uint32_t devices, int mode);
+
+    // Rate and period size the PCM runs with, while it is open.
+    status_t            getParams(uint32_t *rate, snd_pcm_uframes_t *periodSize);
+
+    capture_reader_t *  addReader(uint32_t rate, uint32_t channels, nsecs_t startTime = 0);
+    void                removeReader(capture_reader_t *reader);
+
+    // Blocking; returns the number of frames read at the reader format.
+    ssize_t             read(capture_reader_t *reader, void *buffer, size_t frames);
+
+    // Frames lost by the reader since the last call.
+    unsigned int        framesLost(capture_reader_t *reader);
+
+    // Position, in reader frames, and CLOCK_MONOTONIC capture time of the
+    // first frame returned by the last read.
+    status_t            getTimestamp(capture_reader_t *reader, int64_t *frames, nsecs_t *time);
+
+    // Whether the last read held speech: 1 if so, 0 if not, -1 if unknown.
+    int                 voiceActivity(capture_reader_t *reader);
+
+    // The acoustics module processes the shared capture once for all
+    // readers, so it runs every stage that any open input stream asked
+    // for: the flags of the streams are or-ed together.
+    status_t            addAcoustics(int flags);
+    void                removeAcoustics(int flags);
+    status_t            setAcousticParams(void *params);
+
+    // Restart capture and the output together and service both; the
+    // output must have a render callback. The callback runs with mLock
+    // held from then on, starting with the periods priming the output,
+    // and capture calls from it are refused rather than wait on it.
+    status_t            link(AudioStreamOutALSA *out);
+    void                unlink(AudioStreamOutALSA *out);
+
+    status_t            dump(int fd);
+
+private:
+    friend class ALSACaptureThread;
+    friend class ALSAProcessThread;
+
+    status_t            start();
+    void                stop();
+    void                shutdown();
+
+    void                standby();
+    status_t            resume();
+    void                retainParams();
+    void                unlinkDuplex();
+    bool                renderDuplex(snd_pcm_uframes_t limit);
+    bool                rendering();
+
+    bool                captureLoop();
+    bool                processLoop();
+    void                markActivity(uint32_t pos, uint32_t frames, int speech);
+    int                 activity(uint32_t pos, uint32_t end);
+    void                resync(uint32_t pos);
+    void                lost(uint32_t pos, snd_pcm_sframes_t frames);
+    nsecs_t             frameTime(uint32_t pos);
+    size_t              convert(capture_reader_t *reader, void *buffer,
+                                size_t frames, uint32_t avail);
+    status_t            applyAcoustics(void *params);
+
+    AudioHardwareALSA * mParent;
+    alsa_handle_t *     mHandle;
+    alsa_handle_t       mConfig;        // the device entry, as the first client asked
+    int                 mClients;
+
+    Mutex               mLock;          // PCM access
+    Mutex               mStateLock;     // readers joining and leaving
+    Vector<int>         mAcoustics;     // of the input streams, under mStateLock
+    sp<ALSACaptureThread> mThread;
+    sp<ALSAProcessThread> mProcessThread;
+
+    bool                mPipelined;
+    bool                mStandby;
+    snd_pcm_hw_params_t * mHwParams;    // retained for resume
+    snd_pcm_sw_params_t * mSwParams;
+
+    char *              mRing;
+    uint8_t *           mActivity;      // voice activity of the ring
+    uint32_t            mRingFrames;    // power of two
+    size_t              mFrameSize;
+    volatile int32_t    mRawPos;        // frames captured, wraps
+    volatile int32_t    mWritePos;      // frames ready for readers, wraps
+    volatile int32_t    mHwLost;        // frames dropped by the hardware
+    int64_t             mCaptured;      // frames read since the PCM was opened
+
+    unsigned int        mDefaultLatency;
+    uint32_t            mHistory;       // ms, alsa.capture.history_ms
+
+    Mutex               mWaitLock;      // readers and their accounting
+    Condition           mWait;
+    Vector<capture_reader_t *> mReaders;
+
+    uint32_t            mAnchorPos;     // ring position of a frame
+    nsecs_t             mAnchorTime;    // and when it was captured
+    uint32_t            mResumePos;     // ring position capture last started at
+
+    uint32_t            mRate;          // of the open PCM, or 0
+    snd_pcm_uframes_t   mPeriodSize;
+
+    int32_t             mProcessLostSeen;
+    capture_stats_t     mReadStats;     // waiting for the hardware
+    capture_stats_t     mProcessStats;  // in the acoustics module
+    uint32_t            mMaxBacklog;    // captured frames waiting for processing
+
+    AudioStreamOutALSA * mDuplexOut;    // linked output, under mLock
+    snd_pcm_uframes_t   mDuplexDelay;   // frames from a write to its capture
+    volatile android_thread_id_t mRenderingThread;  // calling the output back
+    bool                mUnlinkPending; // asked for from the callback
 };
 
 class ALSAStreamOps
@@ -165,21 +509,66 @@ protected:
 
 // ----------------------------------------------------------------------------
 
+class ALSARenderThread;
+class ALSASwitchThread;
+
+enum {
+    SWITCH_OPENING,
+    SWITCH_READY,
+    SWITCH_FAILED
+};
+
+/**
+ * Fills 'buffer' with up to 'frames' frames in the stream format: all the
+ * room there is in the PCM, in whole periods. The first of them is frame
+ * 'position' of the stream and plays at 'time' (CLOCK_MONOTONIC, in ns).
+ * Returns the frames rendered; the rest of the buffer is played as silence.
+ * In duplex mode it runs with the capture lock held, on the capture thread
+ * or, for the first periods, on the one setting the callback: it must not
+ * read, route, open or close input streams, which is refused if it does.
+ */
+typedef size_t (*render_callback_t)(void *cookie, void *buffer, size_t frames,
+                                    int64_t position, nsecs_t time);
+
+enum {
+    TIMED_ROUTE,
+    TIMED_VOLUME
+};
+
+// A routing or volume change due when a given stream frame is written.
+struct timed_command_t {
+    int64_t             frame;
+    int                 type;
+    uint32_t            device;     // TIMED_ROUTE
+    int32_t             gain;       // TIMED_VOLUME, Q15
+};
+
 class AudioStreamOutALSA : public AudioStreamOut, public ALSAStreamOps
 {
 public:
     AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle);
     virtual            ~AudioStreamOutALSA();
 
+    // The routing and volume given with one of these happen exactly at
+    // that stream frame, or at the frame that plays at that CLOCK_MONOTONIC
+    // time, in ns. Asked for, keyAtFrame gives the frame playing now.
+    static const char * const keyAtFrame;
+    static const char * const keyAtTime;
+
+    // CLOCK_MONOTONIC time, in ns, the next write is to play at; silence
+    // makes up the difference.
+    static const char * const keyStartTime;
+
+    // A gain, 0 to 1, applied to the stream in software.
+    static const char * const keyVolume;
+
     virtual uint32_t    sampleRate() const
     {
         return ALSAStreamOps::sampleRate();
     }
 
-    virtual size_t      bufferSize() const
-    {
-        return ALSAStreamOps::bufferSize();
-    }
+    // A whole number of periods.
+    virtual size_t      bufferSize() const;
 
     virtual uint32_t    channels() const;
 
@@ -197,13 +586,8 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs) {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
-
-    virtual String8     getParameters(const String8& keys) {
-        return ALSAStreamOps::getParameters(keys);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
+    virtual String8     getParameters(const String8& keys);
 
     // return the number of audio frames written by the audio dsp to DAC since
     // the output has exited standby
@@ -212,8 +596,115 @@ public:
     status_t            open(int mode);
     status_t            close();
 
+    // Callback mode: a thread of the HAL's calls 'callback' every period
+    // for what the PCM has room for, and write() is refused. A NULL
+    // callback goes back to write(), as does standby().
+    status_t            setRenderCallback(render_callback_t callback, void *cookie);
+
 private:
+    friend class ALSARenderThread;
+    friend class ALSACapture;
+
+    bool                renderLoop();
+    bool                render(snd_pcm_uframes_t limit);
+    status_t            startRender();
+    void                stopRender();
+    status_t            leaveDuplex();
+
+    ssize_t             writeSegment(const char *buffer, snd_pcm_uframes_t frames);
+    ssize_t             writeSilence(int64_t frames);
+    ssize_t             writeFrames(const char *data, snd_pcm_uframes_t frames);
+    const char *        applyGain(const char *data, snd_pcm_uframes_t frames);
+
+    bool                startSwitch(uint32_t device);
+    void                cancelSwitch(bool apply);
+    status_t            routeNow(uint32_t device);
+    ssize_t             crossfade(const char *data, snd_pcm_uframes_t frames);
+
+    bool                adaptXrun();
+    void                adaptSlack(snd_pcm_sframes_t slack);
+    status_t            resize(unsigned int latency, const char *reason);
+
+    int64_t             timeToFrame(nsecs_t time);
+    status_t            queueCommand(const timed_command_t& command);
+    void                runCommands(int64_t frame);
+    bool                prepareStage(snd_pcm_uframes_t period);
+    void                setWakeup();
+
+    void                enterWarmStandby();
+    status_t            leaveWarmStandby();
+
     uint32_t framesRendered;
+    int64_t             mFramesWritten;
+
+    // Writes are staged so that the PCM only gets whole periods, unless
+    // alsa.output.staging is 0.
+    bool                mStaging;
+    char *              mStage;
+    snd_pcm_uframes_t   mStagePeriod;
+    snd_pcm_uframes_t   mStaged;
+    snd_pcm_sw_params_t * mSwParams;
+    snd_pcm_uframes_t   mAvailMin;      // frames free before a write wakes
+
+    // For dump(): client writes, snd_pcm_writei() calls, and the times the
+    // driver has to wake us for a period, against the frames written.
+    uint32_t            mWrites;
+    uint32_t            mSyscalls;
+    uint32_t            mWakeups;
+    uint64_t            mStatFrames;
+
+    // Long enough silence puts the PCM in warm standby: stopped, but still
+    // configured, while writes are consumed at the stream rate.
+    int16_t             mSilenceThreshold;  // alsa.output.silence.threshold
+    uint32_t            mSilenceLimit;      // frames, or 0
+    uint32_t            mSilentFrames;
+    bool                mWarmStandby;
+    nsecs_t             mSilenceClock;      // when the next write is due
+
+    sp<ALSARenderThread> mRenderThread;
+    render_callback_t   mRenderCallback;
+    void *              mRenderCookie;
+    char *              mRender;
+    snd_pcm_uframes_t   mRenderFrames;      // what mRender holds
+
+    // Timed commands in frame order, run between writes.
+    Vector<timed_command_t> mCommands;
+    nsecs_t             mStartTime;         // for the next write, or 0
+    int32_t             mGain;              // Q15
+    int32_t             mGainTarget;
+    int32_t             mTrim;              // Q15, the volume the mixer cannot give
+    char *              mGainBuffer;
+    size_t              mGainBufferSize;
+
+    // A routing change opens the new PCM on a thread while the old one
+    // plays, and crossfades once both the PCM and the change are due.
+    bool                mSeamless;          // alsa.output.seamless
+    snd_pcm_uframes_t   mCrossfadeFrames;   // alsa.output.crossfade_ms
+    sp<ALSASwitchThread> mSwitch;
+    bool                mSwitchArmed;
+
+    // A route asked for while the PCM is linked to the capture waits for
+    // the link to go.
+    bool                mRouteDeferred;
+    uint32_t            mDeferredRoute;
+
+    // The buffer grows after repeated underruns, when the PCM has stopped
+    // anyway, and shrinks after a stable while at the next gap in the
+    // sound: warm standby or standby.
+    bool                mAdaptive;          // alsa.output.adaptive
+    unsigned int        mMinLatency;        // us
+    unsigned int        mMaxLatency;        // us
+    uint32_t            mGrowXruns;         // underruns within mXrunWindow to grow
+    nsecs_t             mXrunWindow;
+    nsecs_t             mStableTime;        // without underruns, to shrink
+    nsecs_t             mWindowStart;
+    uint32_t            mWindowXruns;
+    nsecs_t             mStableSince;
+    snd_pcm_sframes_t   mMinSlack;          // frames left when a write came
+    unsigned int        mPendingLatency;    // us, for the next gap, or 0
+    int                 mShrinkHold;        // stable periods to wait out
+    uint32_t            mXruns;
+    uint32_t            mResizes;
 };
 
 class AudioStreamInALSA : public AudioStreamIn, public ALSAStreamOps
@@ -224,21 +715,23 @@ public:
             AudioSystem::audio_in_acoustics audio_acoustics);
     virtual            ~AudioStreamInALSA();
 
-    virtual uint32_t    sampleRate() const
-    {
-        return ALSAStreamOps::sampleRate();
-    }
+    // CLOCK_MONOTONIC time, in ns, of the first frame the next read returns
+    // after the stream is opened or leaves standby. Capture history must be
+    // enabled to reach back more than the ring holds.
+    static const char * const keyStartTime;
 
-    virtual size_t      bufferSize() const
-    {
-        return ALSAStreamOps::bufferSize();
-    }
+    // The stream format may differ from the hardware one; the capture
+    // engine converts rate and channels for each reader.
+    status_t            set(int *format, uint32_t *channels, uint32_t *rate);
 
-    virtual uint32_t    channels() const
+    virtual uint32_t    sampleRate() const
     {
-        return ALSAStreamOps::channels();
+        return mSampleRate;
     }
 
+    virtual size_t      bufferSize() const;
+    virtual uint32_t    channels() const;
+
     virtual int         format() const
     {
         return ALSAStreamOps::format();
@@ -251,15 +744,9 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs)
-    {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
 
-    virtual String8     getParameters(const String8& keys)
-    {
-        return ALSAStreamOps::getParameters(keys);
-    }
+    virtual String8     getParameters(const String8& keys);
 
     /**
      * Return the amount of input frames lost in the audio driver since the last
@@ -272,6 +759,23 @@ public:
      */
     virtual unsigned int  getInputFramesLost() const;
 
+    /**
+     * Return the position, in frames at the stream rate counting both the
+     * frames read and the frames lost, and the CLOCK_MONOTONIC capture time
+     * of the first frame returned by the last read().
+     */
+    status_t            getCaptureTimestamp(int64_t *frames, nsecs_t *time);
+
+    /**
+     * Whether the acoustics module heard speech in the frames returned by
+     * the last read(): 1 if so, 0 if not, -1 if it cannot tell.
+     */
+    int                 getVoiceActivity();
+
+    static const char * const keyCaptureFrames;
+    static const char * const keyCaptureTime;
+    static const char * const keyCaptureSpeech;
+
     status_t            setAcousticParams(void* params);
 
     status_t            open(int mode);
@@ -279,8 +783,12 @@ public:
 
 private:
     AudioSystem::audio_in_acoustics mAcoustics;
-    void                resetFramesLost();
-    unsigned int framesLost;
+
+    uint32_t            mSampleRate;
+    uint32_t            mChannelCount;
+    bool                mAttached;
+    capture_reader_t *  mReader;
+    nsecs_t             mStartTime;
 };
 
 class AudioHardwareALSA : public AudioHardwareBase
@@ -353,14 +861,23 @@ public:
         return mMode;
     }
 
+    /**
+     * Borrow the long-lived control handle of a card. The handle is opened
+     * on first use and stays open until the hardware is destroyed, so
+     * callers must not delete it.
+     */
+    ALSAControl *       control(const char *device = "hw:00");
+
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
 
     friend class AudioStreamOutALSA;
     friend class AudioStreamInALSA;
     friend class ALSAStreamOps;
+    friend class ALSACapture;
 
     ALSAMixer *         mMixer;
+    ALSACapture *       mCapture;
 
     alsa_device_t *     mALSADevice;
     acoustic_device_t * mAcousticDevice;
@@ -369,6 +886,9 @@ protected:
 
 private:
     Mutex               mLock;
+
+    Mutex               mControlLock;
+    KeyedVector<String8, ALSAControl *> mControls;
 };
 
 // ----------------------------------------------------------------------------
@@ -36,20 +36,83 @@
 namespace android
 {
 
+const char * const AudioStreamInALSA::keyStartTime = "capture_start_time";
+const char * const AudioStreamInALSA::keyCaptureFrames = "capture_frames";
+const char * const AudioStreamInALSA::keyCaptureTime = "capture_time";
+const char * const AudioStreamInALSA::keyCaptureSpeech = "capture_speech";
+
 AudioStreamInALSA::AudioStreamInALSA(AudioHardwareALSA *parent,
         alsa_handle_t *handle,
         AudioSystem::audio_in_acoustics audio_acoustics) :
     ALSAStreamOps(parent, handle),
-    mAcoustics(audio_acoustics)
+    mAcoustics(audio_acoustics),
+    mSampleRate(handle->sampleRate),
+    mChannelCount(handle->channels > 2 ? 1 : handle->channels),
+    mAttached(true),
+    mReader(0),
+    mStartTime(0)
 {
-    acoustic_device_t *aDev = acoustics();
-
-    if (aDev) aDev->set_params(aDev, mAcoustics, NULL);
+    mParent->mCapture->addAcoustics(mAcoustics);
 }
 
 AudioStreamInALSA::~AudioStreamInALSA()
 {
     close();
+
+    mParent->mCapture->removeAcoustics(mAcoustics);
+
+    // The PCM belongs to the capture engine, not to this stream.
+    mHandle = NULL;
+}
+
+status_t AudioStreamInALSA::set(int      *format,
+                                uint32_t *channels,
+                                uint32_t *rate)
+{
+    uint32_t sampleRate = rate && *rate ? *rate : mSampleRate;
+    uint32_t count = channels && *channels ? AudioSystem::popCount(*channels) : mChannelCount;
+
+    status_t err = ALSAStreamOps::set(format, NULL, NULL);
+    if (err != NO_ERROR) return err;
+
+    // Only 16 bit capture can be converted.
+    if ((sampleRate != mHandle->sampleRate || count != mHandle->channels) &&
+        mHandle->format != SND_PCM_FORMAT_S16_LE)
+        return BAD_VALUE;
+
+    if (sampleRate < 8000 || sampleRate > 48000 || count < 1 || count > 2)
+        return BAD_VALUE;
+
+    mSampleRate = sampleRate;
+    mChannelCount = count;
+
+    if (rate) *rate = mSampleRate;
+    if (channels) *channels = this->channels();
+
+    return NO_ERROR;
+}
+
+//
+// One hardware period, at the rate of this stream.
+//
+size_t AudioStreamInALSA::bufferSize() const
+{
+    if (!mHandle->periodSize)
+        return ALSAStreamOps::bufferSize();
+
+    size_t frames = ((uint64_t)mHandle->periodSize * mSampleRate +
+                     mHandle->sampleRate - 1) / mHandle->sampleRate;
+
+    return frames * mChannelCount * snd_pcm_format_physical_width(mHandle->format) / 8;
+}
+
+uint32_t AudioStreamInALSA::channels() const
+{
+    uint32_t channels = AudioSystem::CHANNEL_IN_LEFT;
+
+    if (mChannelCount > 1) channels |= AudioSystem::CHANNEL_IN_RIGHT;
+
+    return channels;
 }
 
 status_t AudioStreamInALSA::setGain(float gain)
@@ -61,61 +124,128 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 {
     AutoMutex lock(mLock);
 
+    if (!mAttached) return NO_INIT;
+
     if (!mPowerLock) {
         acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioInLock");
         mPowerLock = true;
     }
 
-    acoustic_device_t *aDev = acoustics();
-
-    // If there is an acoustics module read method, then it overrides this
-    // implementation (unlike AudioStreamOutALSA write).
-    if (aDev && aDev->read)
-        return aDev->read(aDev, buffer, bytes);
-
-    snd_pcm_sframes_t n, frames = snd_pcm_bytes_to_frames(mHandle->handle, bytes);
-    status_t          err;
-
-    do {
-        n = snd_pcm_readi(mHandle->handle, buffer, frames);
-        if (n < frames) {
-            if (mHandle->handle) {
-                if (n < 0) {
-                    n = snd_pcm_recover(mHandle->handle, n, 0);
-
-                    /* there was an error, count this whole buffer as lost frames */
-                    framesLost += frames;
-
-                    if (aDev && aDev->recover) aDev->recover(aDev, n);
-                } else {
-                    /* not an error, but not all the requested frames were read */
-                    framesLost += frames - n;
-                    n = snd_pcm_prepare(mHandle->handle);
-                  }
-            }
-            return static_cast<ssize_t>(n);
-        }
-    } while (n == -EAGAIN);
+    ALSACapture *capture = mParent->mCapture;
+
+    // Start reading from the current capture position, or from the
+    // requested start time.
+    if (!mReader) {
+        mReader = capture->addReader(mSampleRate, mChannelCount, mStartTime);
+        if (!mReader) return NO_INIT;
+        mStartTime = 0;
+    }
+
+    size_t frameSize = mChannelCount * snd_pcm_format_physical_width(mHandle->format) / 8;
+    ssize_t n = capture->read(mReader, buffer, bytes / frameSize);
 
-    return static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
+    if (n < 0) return n;
+
+    return n * frameSize;
 }
 
 status_t AudioStreamInALSA::dump(int fd, const Vector<String16>& args)
 {
-    return NO_ERROR;
+    return mParent->mCapture->dump(fd);
 }
 
-status_t AudioStreamInALSA::open(int mode)
+status_t AudioStreamInALSA::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(AudioParameter::keyRouting);
+    status_t status = NO_ERROR;
+    int device;
+    LOGV("setParameters() %s", keyValuePairs.string());
+
+    // The PCM is shared, so reroute it through the capture engine.
+    if (param.getInt(key, device) == NO_ERROR) {
+        mParent->mCapture->route((uint32_t)device, mParent->mode());
+        param.remove(key);
+    }
+
+    key = String8(keyStartTime);
+    String8 value;
+
+    if (param.get(key, value) == NO_ERROR) {
+        AutoMutex lock(mLock);
+
+        mStartTime = strtoll(value.string(), NULL, 0);
+
+        // Rejoin the ring at the start time on the next read.
+        if (mReader) {
+            mParent->mCapture->removeReader(mReader);
+            mReader = NULL;
+        }
+        param.remove(key);
+    }
+
+    if (param.size()) {
+        status = BAD_VALUE;
+    }
+    return status;
+}
+
+String8 AudioStreamInALSA::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(ALSAStreamOps::getParameters(keys));
+    String8 key;
+    String8 value;
+    int64_t frames;
+    nsecs_t time;
+
+    if (getCaptureTimestamp(&frames, &time) == NO_ERROR) {
+        char buf[32];
+
+        key = String8(keyCaptureFrames);
+        if (param.get(key, value) == NO_ERROR) {
+            snprintf(buf, sizeof(buf), "%lld", (long long)frames);
+            param.add(key, String8(buf));
+        }
+
+        key = String8(keyCaptureTime);
+        if (param.get(key, value) == NO_ERROR) {
+            snprintf(buf, sizeof(buf), "%lld", (long long)time);
+            param.add(key, String8(buf));
+        }
+    }
+
+    key = String8(keyCaptureSpeech);
+    if (param.get(key, value) == NO_ERROR) {
+        int speech = getVoiceActivity();
+        if (speech >= 0) param.add(key, String8(speech ? "1" : "0"));
+    }
+
+    return param.toString();
+}
+
+status_t AudioStreamInALSA::getCaptureTimestamp(int64_t *frames, nsecs_t *time)
 {
     AutoMutex lock(mLock);
 
-    status_t status = ALSAStreamOps::open(mode);
-    framesLost = 0;
+    return mParent->mCapture->getTimestamp(mReader, frames, time);
+}
 
-    acoustic_device_t *aDev = acoustics();
+int AudioStreamInALSA::getVoiceActivity()
+{
+    AutoMutex lock(mLock);
 
-    if (status == NO_ERROR && aDev)
-        status = aDev->use_handle(aDev, mHandle);
+    return mParent->mCapture->voiceActivity(mReader);
+}
+
+status_t AudioStreamInALSA::open(int mode)
+{
+    AutoMutex lock(mLock);
+
+    if (mAttached)
+        return mParent->mCapture->route(mHandle->curDev, mode);
+
+    status_t status = mParent->mCapture->attach(mHandle, mHandle->curDev, mode);
+    mAttached = (status == NO_ERROR);
 
     return status;
 }
@@ -124,13 +254,17 @@ status_t AudioStreamInALSA::close()
 {
     AutoMutex lock(mLock);
 
-    acoustic_device_t *aDev = acoustics();
+    ALSACapture *capture = mParent->mCapture;
 
-    if (mHandle && aDev) {
-        aDev->cleanup(aDev);
+    if (mReader) {
+        capture->removeReader(mReader);
+        mReader = NULL;
     }
 
-    ALSAStreamOps::close();
+    if (mAttached) {
+        capture->detach();
+        mAttached = false;
+    }
 
     if (mPowerLock) {
         release_wake_lock ("AudioInLock");
@@ -143,7 +277,14 @@ status_t AudioStreamInALSA::close()
 status_t AudioStreamInALSA::standby()
 {
     AutoMutex lock(mLock);
-    framesLost = 0;
+
+    // Leave the ring; the next read starts again from the live position.
+    // When no stream is left reading, the capture PCM goes to standby.
+    if (mReader) {
+        mParent->mCapture->removeReader(mReader);
+        mReader = NULL;
+    }
+
     if (mPowerLock) {
         release_wake_lock ("AudioInLock");
         mPowerLock = false;
@@ -152,27 +293,17 @@ status_t AudioStreamInALSA::standby()
     return NO_ERROR;
 }
 
-void AudioStreamInALSA::resetFramesLost()
-{
-    AutoMutex lock(mLock);
-    framesLost = 0;
-}
-
 unsigned int AudioStreamInALSA::getInputFramesLost() const
 {
-    unsigned int count = framesLost;
-    // Stupid interface wants us to have a side effect of clearing the count
-    // but is defined as a const to prevent such a thing.
-    ((AudioStreamInALSA *)this)->resetFramesLost();
-    return count;
+    // The capture engine clears the count of the reader as it returns it.
+    return mParent->mCapture->framesLost(mReader);
 }
+
 status_t AudioStreamInALSA::setAcousticParams(void *params)
 {
     AutoMutex lock(mLock);
 
-    acoustic_device_t *aDev = acoustics();
-
-    return aDev ? aDev->set_params(aDev, mAcoustics, params) : (status_t)NO_ERROR;
+    return mParent->mCapture->setAcousticParams(params);
 }
 
 }       // namespace android
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <dlfcn.h>
 #include <sys/time.h>
+#include <sched.h>
 
 #define LOG_TAG "AudioHardwareALSA"
 #include <utils/Log.h>
@@ -32,6 +33,10 @@
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
 
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
 #include "AudioHardwareALSA.h"
 
 #ifndef ALSA_DEFAULT_SAMPLE_RATE
@@ -45,16 +50,354 @@ namespace android
 
 static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
 
+const char * const AudioStreamOutALSA::keyAtFrame = "at_frame";
+const char * const AudioStreamOutALSA::keyAtTime = "at_time";
+const char * const AudioStreamOutALSA::keyStartTime = "start_time";
+const char * const AudioStreamOutALSA::keyVolume = "volume";
+
+// How long the render thread waits for a period before looking again.
+static const int RENDER_TIMEOUT_MS = 100;
+
+// Stream gain, Q15, and how far it moves a frame towards a new volume.
+static const int32_t GAIN_UNITY = 1 << 15;
+static const int32_t GAIN_STEP = GAIN_UNITY / 64;
+
+static const size_t MAX_TIMED_COMMANDS = 32;
+
+//
+// Whether all 'count' samples are within +-threshold. Gives up at the first
+// block of 32 that is not.
+//
+static bool silent(const int16_t *pcm, size_t count, int16_t threshold)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    int16x8_t limit = vdupq_n_s16(threshold);
+
+    for (; i + 32 <= count; i += 32) {
+        uint16x8_t over = vcgtq_s16(vqabsq_s16(vld1q_s16(pcm + i)), limit);
+        over = vorrq_u16(over, vcgtq_s16(vqabsq_s16(vld1q_s16(pcm + i + 8)), limit));
+        over = vorrq_u16(over, vcgtq_s16(vqabsq_s16(vld1q_s16(pcm + i + 16)), limit));
+        over = vorrq_u16(over, vcgtq_s16(vqabsq_s16(vld1q_s16(pcm + i + 24)), limit));
+
+        uint32x2_t any = vreinterpret_u32_u16(vorr_u16(vget_low_u16(over), vget_high_u16(over)));
+        if (vget_lane_u32(vpmax_u32(any, any), 0)) return false;
+    }
+#endif
+
+    for (; i < count; i++)
+        if (pcm[i] > threshold || pcm[i] < -threshold) return false;
+
+    return true;
+}
+
+//
+// Scale 'count' samples by 'gain', Q15 below unity.
+//
+static void scale(int16_t *dst, const int16_t *src, size_t count, int16_t gain)
+{
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i + 8 <= count; i += 8)
+        vst1q_s16(dst + i, vqrdmulhq_n_s16(vld1q_s16(src + i), gain));
+#endif
+
+    for (; i < count; i++)
+        dst[i] = (int16_t)(((int32_t)src[i] * gain + (1 << 14)) >> 15);
+}
+
+//
+// Copy 'frames' frames of 'channels' samples, with a gain going linearly
+// from 'from' towards 'to' over them.
+//
+static void ramp(int16_t *dst, const int16_t *src, size_t frames, unsigned int channels,
+                 float from, float to)
+{
+    float step = frames ? (to - from) / frames : 0;
+    size_t i = 0;
+
+#ifdef __ARM_NEON__
+    if (channels == 1 || channels == 2) {
+        // Four samples at a time: four frames, or two of two channels.
+        unsigned int perVector = 4 / channels;
+        float lanes[4];
+
+        for (unsigned int l = 0; l < 4; l++)
+            lanes[l] = from + step * (l / channels);
+
+        float32x4_t gain = vld1q_f32(lanes);
+        float32x4_t inc = vdupq_n_f32(step * perVector);
+
+        for (; i + perVector <= frames; i += perVector) {
+            float32x4_t f = vcvtq_f32_s32(vmovl_s16(vld1_s16(src + i * channels)));
+            vst1_s16(dst + i * channels, vqmovn_s32(vcvtq_s32_f32(vmulq_f32(f, gain))));
+            gain = vaddq_f32(gain, inc);
+        }
+    }
+#endif
+
+    for (; i < frames; i++) {
+        float gain = from + step * i;
+        for (unsigned int c = 0; c < channels; c++)
+            dst[i * channels + c] = (int16_t)(src[i * channels + c] * gain);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+class ALSARenderThread : public Thread
+{
+public:
+    ALSARenderThread(AudioStreamOutALSA *out) :
+        Thread(false),
+        mOut(out)
+    {
+    }
+
+private:
+    virtual status_t readyToRun()
+    {
+        // Under SCHED_FIFO at alsa.output.callback.rt_priority, where the
+        // process is allowed to; 0 keeps the urgent audio priority.
+        char value[PROPERTY_VALUE_MAX];
+        struct sched_param param;
+
+        property_get("alsa.output.callback.rt_priority", value, "2");
+        param.sched_priority = atoi(value);
+
+        if (param.sched_priority > 0 && sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+            LOGW("Render thread not real-time: %s", strerror(errno));
+
+        return NO_ERROR;
+    }
+
+    virtual bool threadLoop()
+    {
+        return mOut->renderLoop();
+    }
+
+    AudioStreamOutALSA *    mOut;
+};
+
+//
+// Opens the PCM for a new route next to the one playing, then waits to be
+// handed the old one, to drain and close it, or to be cancelled. It never
+// calls back into the stream, which may be gone by then.
+//
+class ALSASwitchThread : public Thread
+{
+public:
+    ALSASwitchThread(const alsa_handle_t& handle, uint32_t device, int mode) :
+        Thread(false),
+        mNext(handle),
+        mDevice(device),
+        mMode(mode),
+        mState(SWITCH_OPENING),
+        mDone(false),
+        mTaken(false),
+        mRetired(handle)
+    {
+        mNext.handle = NULL;
+        mRetired.handle = NULL;
+    }
+
+    uint32_t device() const
+    {
+        return mDevice;
+    }
+
+    int state()
+    {
+        AutoMutex lock(mLock);
+        return mState;
+    }
+
+    // SWITCH_READY only.
+    alsa_handle_t next()
+    {
+        AutoMutex lock(mLock);
+        return mNext;
+    }
+
+    // The new PCM is the stream's now; 'old' is the thread's.
+    void retire(const alsa_handle_t& old)
+    {
+        AutoMutex lock(mLock);
+        mRetired = old;
+        mTaken = true;
+        mDone = true;
+        mCond.signal();
+    }
+
+    void cancel()
+    {
+        AutoMutex lock(mLock);
+        mDone = true;
+        mCond.signal();
+    }
+
+private:
+    virtual bool threadLoop()
+    {
+        alsa_handle_t next = mNext;
+        nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+        status_t err = next.module->open(&next, mDevice, mMode);
+        alsa_handle_t old;
+
+        {
+            AutoMutex lock(mLock);
+
+            if (err != NO_ERROR || !next.handle) {
+                LOGW("Unable to open 0x%08x next to the playing route, switching with a gap",
+                     mDevice);
+                next.module->close(&next);
+                mState = SWITCH_FAILED;
+                return false;
+            }
+
+            LOGV("Opened 0x%08x in %lld us", mDevice,
+                 ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+
+            mNext = next;
+            mState = SWITCH_READY;
+
+            while (!mDone) mCond.wait(mLock);
+
+            if (!mTaken) {
+                mNext.module->close(&mNext);
+                return false;
+            }
+
+            old = mRetired;
+        }
+
+        // Play out the end of the crossfade.
+        if (old.handle) old.module->close(&old);
+
+        return false;
+    }
+
+    Mutex                   mLock;
+    Condition               mCond;
+    alsa_handle_t           mNext;
+    uint32_t                mDevice;
+    int                     mMode;
+    int                     mState;
+    bool                    mDone;
+    bool                    mTaken;
+    alsa_handle_t           mRetired;
+};
+
 // ----------------------------------------------------------------------------
 
 AudioStreamOutALSA::AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle) :
-    ALSAStreamOps(parent, handle)
+    ALSAStreamOps(parent, handle),
+    mFramesWritten(0),
+    mStaging(true),
+    mStage(0),
+    mStagePeriod(0),
+    mStaged(0),
+    mSwParams(0),
+    mAvailMin(0),
+    mWrites(0),
+    mSyscalls(0),
+    mWakeups(0),
+    mStatFrames(0),
+    mSilenceThreshold(0),
+    mSilenceLimit(0),
+    mSilentFrames(0),
+    mWarmStandby(false),
+    mSilenceClock(0),
+    mRenderCallback(0),
+    mRenderCookie(0),
+    mRender(0),
+    mRenderFrames(0),
+    mStartTime(0),
+    mGain(GAIN_UNITY),
+    mGainTarget(GAIN_UNITY),
+    mTrim(GAIN_UNITY),
+    mGainBuffer(0),
+    mGainBufferSize(0),
+    mSeamless(true),
+    mCrossfadeFrames(0),
+    mSwitchArmed(false),
+    mRouteDeferred(false),
+    mDeferredRoute(0),
+    mAdaptive(true),
+    mMinLatency(0),
+    mMaxLatency(0),
+    mGrowXruns(0),
+    mXrunWindow(0),
+    mStableTime(0),
+    mWindowStart(0),
+    mWindowXruns(0),
+    mStableSince(0),
+    mMinSlack(0),
+    mPendingLatency(0),
+    mShrinkHold(0),
+    mXruns(0),
+    mResizes(0)
 {
+    acoustic_device_t *aDev = acoustics();
+
+    // Tell the acoustics module the format of what it gets through write().
+    if (aDev) aDev->use_handle(aDev, handle);
+
+    // Writes with no sample beyond alsa.output.silence.threshold for
+    // alsa.output.silence.standby_ms (0 disables) stop the PCM.
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("alsa.output.silence.threshold", value, "4");
+    mSilenceThreshold = atoi(value);
+
+    property_get("alsa.output.silence.standby_ms", value, "5000");
+    mSilenceLimit = (uint64_t)atoi(value) * handle->sampleRate / 1000;
+
+    property_get("alsa.output.staging", value, "1");
+    mStaging = atoi(value);
+
+    // Routing changes crossfade over alsa.output.crossfade_ms between the
+    // old PCM and a new one, unless alsa.output.seamless is 0.
+    property_get("alsa.output.seamless", value, "1");
+    mSeamless = atoi(value);
+
+    property_get("alsa.output.crossfade_ms", value, "10");
+    mCrossfadeFrames = (snd_pcm_uframes_t)atoi(value) * handle->sampleRate / 1000;
+
+    // The buffer grows on underruns and shrinks when they stop, within
+    // alsa.output.latency.min_ms and max_ms, unless alsa.output.adaptive
+    // is 0.
+    property_get("alsa.output.adaptive", value, "1");
+    mAdaptive = atoi(value);
+
+    property_get("alsa.output.latency.min_ms", value, "40");
+    mMinLatency = atoi(value) * 1000;
+
+    property_get("alsa.output.latency.max_ms", value, "800");
+    mMaxLatency = atoi(value) * 1000;
+
+    property_get("alsa.output.adaptive.xruns", value, "2");
+    mGrowXruns = atoi(value);
+
+    property_get("alsa.output.adaptive.window_ms", value, "10000");
+    mXrunWindow = milliseconds(atoi(value));
+
+    property_get("alsa.output.adaptive.stable_s", value, "60");
+    mStableTime = seconds(atoi(value));
+
+    mStableSince = systemTime(SYSTEM_TIME_MONOTONIC);
+    mMinSlack = handle->bufferSize;
 }
 
 AudioStreamOutALSA::~AudioStreamOutALSA()
 {
     close();
+    free(mStage);
+    free(mRender);
+    free(mGainBuffer);
+    if (mSwParams) snd_pcm_sw_params_free(mSwParams);
 }
 
 uint32_t AudioStreamOutALSA::channels() const
@@ -65,14 +408,32 @@ uint32_t AudioStreamOutALSA::channels() const
 
 status_t AudioStreamOutALSA::setVolume(float left, float right)
 {
-    return mixer()->setVolume (mHandle->curDev, left, right);
+    status_t err = mixer()->setVolume (mHandle->curDev, left, right);
+
+    // The element moves in steps of its own; the stream gain takes off what
+    // the nearest step gives over the volume, and what the element cannot
+    // attenuate any further.
+    const volume_curve_t *curve = mixer()->volumeCurve(mHandle->curDev, SND_PCM_STREAM_PLAYBACK);
+    float residual = 1.0f;
+
+    if (err == NO_ERROR && curve && curve->count) curve->lookup(left, &residual);
+    if (residual > 1.0f) residual = 1.0f;
+
+    AutoMutex lock(mLock);
+    mTrim = (int32_t)(residual * GAIN_UNITY + 0.5f);
+
+    return err;
 }
 
 ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 {
     AutoMutex lock(mLock);
 
-    if (!mPowerLock) {
+    // The render callback is the only writer in callback mode.
+    if (mRenderCallback) return INVALID_OPERATION;
+
+    // Warm standby does without the wake lock until the sound comes back.
+    if (!mPowerLock && !mWarmStandby) {
         acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
         mPowerLock = true;
     }
@@ -83,23 +444,681 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 	     mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
          nsecs_t delta = systemTime() - previously;
          LOGE("RE-OPEN AFTER STANDBY:: took %llu msecs\n", ns2ms(delta));
+         mFramesWritten = 0;
 	}
 
+    const char *data = (const char *)buffer;
+    size_t frameSize = snd_pcm_frames_to_bytes(mHandle->handle, 1);
+    snd_pcm_uframes_t left = snd_pcm_bytes_to_frames(mHandle->handle, bytes);
+
+    mWrites++;
+
+    // Silence first, so that the buffer plays at the start time.
+    if (mStartTime) {
+        int64_t pad = timeToFrame(mStartTime) - mFramesWritten;
+        mStartTime = 0;
+
+        if (pad > 0) {
+            ssize_t n = writeSilence(pad);
+            if (n < 0) return n;
+        }
+    }
+
+    // Timed commands split the buffer at their frames.
+    while (left) {
+        snd_pcm_uframes_t frames = left;
+
+        if (!mCommands.isEmpty() && mCommands[0].frame < mFramesWritten + (int64_t)left)
+            frames = mCommands[0].frame > mFramesWritten ? mCommands[0].frame - mFramesWritten : 0;
+
+        if (frames) {
+            ssize_t n = writeSegment(data, frames);
+            if (n < 0) return n;
+
+            data += n * frameSize;
+            left -= n;
+            if ((snd_pcm_uframes_t)n < frames) break;
+        }
+
+        runCommands(mFramesWritten);
+    }
+
+    return bytes - left * frameSize;
+}
+
+//
+// Write 'frames' frames the way write() does, through warm standby and
+// the staging buffer. Called with mLock held.
+//
+ssize_t AudioStreamOutALSA::writeSegment(const char *buffer, snd_pcm_uframes_t frames)
+{
+    size_t bytes = snd_pcm_frames_to_bytes(mHandle->handle, frames);
+
+    buffer = applyGain(buffer, frames);
+
+    if (mSilenceLimit && mHandle->format == SND_PCM_FORMAT_S16_LE) {
+        if (!silent((const int16_t *)buffer, bytes / sizeof(int16_t), mSilenceThreshold))
+            mSilentFrames = 0;
+        else if (mSilentFrames < mSilenceLimit)
+            mSilentFrames += frames;
+
+        if (mSilentFrames >= mSilenceLimit && !mWarmStandby)
+            enterWarmStandby();
+        else if (!mSilentFrames && mWarmStandby)
+            leaveWarmStandby();
+
+        if (mWarmStandby) {
+            // Take the buffer as long as it would take to play it.
+            nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+            if (mSilenceClock < now) mSilenceClock = now;
+            mSilenceClock += (nsecs_t)frames * 1000000000LL / mHandle->sampleRate;
+
+            usleep(ns2us(mSilenceClock - now));
+
+            framesRendered += frames;
+            mFramesWritten += frames;
+            return frames;
+        }
+    }
+
     acoustic_device_t *aDev = acoustics();
 
+    // When the first frame of this buffer will be played, after whatever is
+    // still staged.
+    if (aDev && aDev->timestamp) {
+        snd_pcm_sframes_t delay;
+        if (snd_pcm_delay(mHandle->handle, &delay) < 0) delay = 0;
+        aDev->timestamp(aDev, SND_PCM_STREAM_PLAYBACK, mFramesWritten,
+                systemTime(SYSTEM_TIME_MONOTONIC) +
+                (nsecs_t)(delay + mStaged) * 1000000000LL / mHandle->sampleRate);
+    }
+
     // For output, we will pass the data on to the acoustics module, but the actual
     // data is expected to be sent to the audio device directly as well.
     if (aDev && aDev->write)
         aDev->write(aDev, buffer, bytes);
 
+    mStatFrames += frames;
+
+    if (mStaging) setWakeup();
+
+    const char *data = (const char *)buffer;
+    snd_pcm_uframes_t period = mHandle->periodSize;
+    ssize_t n;
+
+    if (!mStaging || !period || !prepareStage(period)) {
+        n = writeFrames(data, frames);
+        if (n < 0) return n;
+
+        mFramesWritten += n;
+        return n;
+    }
+
+    size_t frameSize = snd_pcm_frames_to_bytes(mHandle->handle, 1);
+    snd_pcm_uframes_t left = frames;
+
+    // Complete the staged period first...
+    if (mStaged) {
+        snd_pcm_uframes_t take = period - mStaged;
+        if (take > left) take = left;
+
+        memcpy(mStage + mStaged * frameSize, data, take * frameSize);
+        mStaged += take;
+        data += take * frameSize;
+        left -= take;
+
+        if (mStaged == period) {
+            mStaged = 0;
+            n = writeFrames(mStage, period);
+            if (n < 0) return n;
+        }
+    }
+
+    // ...then whole periods straight from the buffer, and keep the rest.
+    snd_pcm_uframes_t whole = left - left % period;
+    if (whole) {
+        n = writeFrames(data, whole);
+        if (n < 0) return n;
+
+        data += whole * frameSize;
+        left -= whole;
+    }
+
+    if (left && mHandle->handle) {
+        memcpy(mStage, data, left * frameSize);
+        mStaged = left;
+    }
+
+    mFramesWritten += frames;
+    return frames;
+}
+
+//
+// 'frames' frames of silence, a period at a time, for a scheduled start.
+// Called with mLock held.
+//
+ssize_t AudioStreamOutALSA::writeSilence(int64_t frames)
+{
+    snd_pcm_uframes_t chunk = mHandle->periodSize ? mHandle->periodSize : 1024;
+    char *zero = (char *)calloc(chunk, snd_pcm_frames_to_bytes(mHandle->handle, 1));
+
+    if (!zero) return NO_MEMORY;
+
+    LOGV("Output starts after %lld frames of silence", frames);
+
+    ssize_t n = 0;
+    while (frames > 0 && mHandle->handle) {
+        n = writeSegment(zero, frames < (int64_t)chunk ? frames : chunk);
+        if (n <= 0) break;
+        frames -= n;
+    }
+
+    free(zero);
+
+    return n < 0 ? n : NO_ERROR;
+}
+
+//
+// The stream gain applied to 'frames' frames, ramping to a new volume a
+// step a frame. Returns 'data' itself at unity gain, or a scaled copy.
+// The gain is the scheduled volume times what the mixer element left of
+// setVolume(). Called with mLock held.
+//
+const char *AudioStreamOutALSA::applyGain(const char *data, snd_pcm_uframes_t frames)
+{
+    int32_t target = (int32_t)(((int64_t)mGainTarget * mTrim + (1 << 14)) >> 15);
+
+    if (mGain == GAIN_UNITY && target == GAIN_UNITY) return data;
+
+    if (mHandle->format != SND_PCM_FORMAT_S16_LE) {
+        mGain = target;
+        return data;
+    }
+
+    size_t bytes = snd_pcm_frames_to_bytes(mHandle->handle, frames);
+    if (mGainBufferSize < bytes) {
+        char *buffer = (char *)realloc(mGainBuffer, bytes);
+        if (!buffer) return data;
+        mGainBuffer = buffer;
+        mGainBufferSize = bytes;
+    }
+
+    const int16_t *src = (const int16_t *)data;
+    int16_t *dst = (int16_t *)mGainBuffer;
+    unsigned int channels = mHandle->channels;
+    snd_pcm_uframes_t i = 0;
+
+    for (; i < frames && mGain != target; i++) {
+        if (mGain < target)
+            mGain = mGain + GAIN_STEP < target ? mGain + GAIN_STEP : target;
+        else
+            mGain = mGain - GAIN_STEP > target ? mGain - GAIN_STEP : target;
+
+        for (unsigned int c = 0; c < channels; c++, src++, dst++)
+            *dst = (int16_t)((*src * mGain + (1 << 14)) >> 15);
+    }
+
+    if (mGain == GAIN_UNITY)
+        memcpy(dst, src, (frames - i) * channels * sizeof(int16_t));
+    else
+        scale(dst, src, (frames - i) * channels, mGain);
+
+    return mGainBuffer;
+}
+
+//
+// The stream frame that plays at CLOCK_MONOTONIC 'time', counting what is
+// staged and queued in the PCM. Called with mLock held.
+//
+int64_t AudioStreamOutALSA::timeToFrame(nsecs_t time)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    int64_t playing = mFramesWritten - mStaged;
+
+    if (mWarmStandby) {
+        if (mSilenceClock > now)
+            playing -= (mSilenceClock - now) * mHandle->sampleRate / 1000000000LL;
+    } else if (mHandle->handle) {
+        snd_pcm_sframes_t delay;
+        if (snd_pcm_delay(mHandle->handle, &delay) == 0) playing -= delay;
+    }
+
+    return playing + (time - now) * mHandle->sampleRate / 1000000000LL;
+}
+
+//
+// Run the timed commands due by stream frame 'frame'. Called with mLock
+// held, between writes.
+//
+void AudioStreamOutALSA::runCommands(int64_t frame)
+{
+    while (!mCommands.isEmpty() && mCommands[0].frame <= frame) {
+        timed_command_t command = mCommands[0];
+        mCommands.removeAt(0);
+
+        switch (command.type) {
+            case TIMED_ROUTE:
+                LOGV("Routing to 0x%08x at frame %lld", command.device, command.frame);
+                routeNow(command.device);
+                break;
+
+            case TIMED_VOLUME:
+                LOGV("Volume %d/32768 from frame %lld", command.gain, command.frame);
+                mGainTarget = command.gain;
+                break;
+        }
+    }
+}
+
+status_t AudioStreamOutALSA::queueCommand(const timed_command_t& command)
+{
+    if (mCommands.size() >= MAX_TIMED_COMMANDS) {
+        LOGW("Timed command queue full, dropping a command for frame %lld", command.frame);
+        return NO_MEMORY;
+    }
+
+    // In frame order, and in the order given for the same frame.
+    size_t i = mCommands.size();
+    while (i > 0 && mCommands[i - 1].frame > command.frame) i--;
+    mCommands.insertAt(command, i);
+
+    return NO_ERROR;
+}
+
+status_t AudioStreamOutALSA::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key;
+    String8 value;
+    status_t status = NO_ERROR;
+    bool unlink;
+
+    {
+        AutoMutex lock(mLock);
+
+        timed_command_t command;
+        bool timed = false;
+        float volume;
+        int device;
+
+        key = String8(keyAtFrame);
+        if (param.get(key, value) == NO_ERROR) {
+            command.frame = strtoll(value.string(), NULL, 0);
+            timed = true;
+            param.remove(key);
+        }
+
+        key = String8(keyAtTime);
+        if (param.get(key, value) == NO_ERROR) {
+            if (!timed) command.frame = timeToFrame(strtoll(value.string(), NULL, 0));
+            timed = true;
+            param.remove(key);
+        }
+
+        key = String8(keyStartTime);
+        if (param.get(key, value) == NO_ERROR) {
+            mStartTime = strtoll(value.string(), NULL, 0);
+            param.remove(key);
+        }
+
+        key = String8(keyVolume);
+        if (param.getFloat(key, volume) == NO_ERROR) {
+            if (volume < 0) volume = 0;
+            if (volume > 1) volume = 1;
+
+            command.type = TIMED_VOLUME;
+            command.gain = (int32_t)(volume * GAIN_UNITY + 0.5f);
+            if (!timed)
+                mGainTarget = command.gain;
+            else if (queueCommand(command) != NO_ERROR)
+                status = NO_MEMORY;
+            param.remove(key);
+        }
+
+        key = String8(AudioParameter::keyRouting);
+        if (timed && param.getInt(key, device) == NO_ERROR) {
+            command.type = TIMED_ROUTE;
+            command.device = (uint32_t)device;
+            if (queueCommand(command) != NO_ERROR) status = NO_MEMORY;
+            else startSwitch(command.device);
+            param.remove(key);
+        }
+
+        // Now, but still without a gap if it can be done.
+        if (!timed && param.getInt(key, device) == NO_ERROR) {
+            routeNow((uint32_t)device);
+            param.remove(key);
+        }
+
+        unlink = mRouteDeferred;
+    }
+
+    if (unlink) mParent->mCapture->unlink(this);
+
+    if (param.size()) {
+        status_t err = ALSAStreamOps::setParameters(param.toString());
+        if (err != NO_ERROR) status = err;
+    }
+
+    return status;
+}
+
+String8 AudioStreamOutALSA::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(ALSAStreamOps::getParameters(keys));
+    String8 key = String8(keyAtFrame);
+    String8 value;
+
+    // The stream frame playing now, to schedule against.
+    if (param.get(key, value) == NO_ERROR) {
+        AutoMutex lock(mLock);
+        char buffer[32];
+
+        snprintf(buffer, sizeof(buffer), "%lld", timeToFrame(systemTime(SYSTEM_TIME_MONOTONIC)));
+        param.add(key, String8(buffer));
+    }
+
+    return param.toString();
+}
+
+status_t AudioStreamOutALSA::setRenderCallback(render_callback_t callback, void *cookie)
+{
+    stopRender();
+    if (!callback) return NO_ERROR;
+
+    AutoMutex lock(mLock);
+
+    if (mHandle->handle == NULL) {
+        mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
+        mFramesWritten = 0;
+    }
+
+    snd_pcm_t *h = mHandle->handle;
+    snd_pcm_uframes_t bufferSize, periodSize;
+
+    if (!h || snd_pcm_get_params(h, &bufferSize, &periodSize) < 0 || !periodSize)
+        return NO_INIT;
+
+    if (mWarmStandby) leaveWarmStandby();
+    mSilentFrames = 0;
+
+    // What write() left staged plays first.
+    if (mStaged) writeFrames(mStage, mStaged);
+    mStaged = 0;
+
+    if (mRenderFrames < bufferSize) {
+        free(mRender);
+        mRender = (char *)malloc(snd_pcm_frames_to_bytes(h, bufferSize));
+        mRenderFrames = mRender ? bufferSize : 0;
+        if (!mRender) return NO_MEMORY;
+    }
+
+    // Wake for every period; write() sets its own wakeup again.
+    if (!mSwParams && snd_pcm_sw_params_malloc(&mSwParams) < 0)
+        mSwParams = NULL;
+    if (mSwParams &&
+        snd_pcm_sw_params_current(h, mSwParams) == 0 &&
+        snd_pcm_sw_params_set_avail_min(h, mSwParams, periodSize) == 0 &&
+        snd_pcm_sw_params(h, mSwParams) == 0)
+        mAvailMin = periodSize;
+    else
+        LOGW("Unable to wake for every period, render callback follows avail_min");
+
+    if (!mPowerLock) {
+        acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
+        mPowerLock = true;
+    }
+
+    mRenderCallback = callback;
+    mRenderCookie = cookie;
+
+    // In duplex mode the capture thread renders too, a period at a time
+    // right after reading one, if the two PCMs can be linked.
+    char value[PROPERTY_VALUE_MAX];
+    property_get("alsa.duplex", value, "1");
+
+    if (atoi(value) && mParent->mCapture->clients()) {
+        mLock.unlock();
+        status_t err = mParent->mCapture->link(this);
+        mLock.lock();
+
+        if (err == NO_ERROR) return NO_ERROR;
+        if (!mRenderCallback) return INVALID_OPERATION;
+    }
+
+    return leaveDuplex();
+}
+
+//
+// Give the render callback a thread of its own. Called with mLock held.
+//
+status_t AudioStreamOutALSA::startRender()
+{
+    if (mRenderThread != NULL) return NO_ERROR;
+
+    mRenderThread = new ALSARenderThread(this);
+    status_t err = mRenderThread->run("ALSARender", ANDROID_PRIORITY_URGENT_AUDIO);
+    if (err != NO_ERROR) {
+        mRenderThread.clear();
+        mRenderCallback = NULL;
+    }
+
+    return err;
+}
+
+//
+// Render on a thread of our own, if there is a callback, now that duplex
+// mode is over or could not start, and take the route asked for while the
+// PCMs were linked. Called with mLock held.
+//
+status_t AudioStreamOutALSA::leaveDuplex()
+{
+    status_t err = mRenderCallback ? startRender() : NO_ERROR;
+
+    if (mRouteDeferred) {
+        mRouteDeferred = false;
+        routeNow(mDeferredRoute);
+    }
+
+    return err;
+}
+
+//
+// Stop the render thread, if any, or leave duplex mode. Called without
+// mLock; a callback may call this through setRenderCallback(NULL) to stop
+// itself, in duplex mode too, where the capture thread unlinks once the
+// callback returns.
+//
+void AudioStreamOutALSA::stopRender()
+{
+    sp<ALSARenderThread> thread;
+
+    // The callback goes first, so that leaving duplex mode does not start
+    // a render thread for it.
+    {
+        AutoMutex lock(mLock);
+        thread = mRenderThread;
+        mRenderThread.clear();
+        mRenderCallback = NULL;
+    }
+
+    // The capture thread holds its lock while it renders for us.
+    mParent->mCapture->unlink(this);
+
+    if (thread != NULL) thread->requestExitAndWait();
+}
+
+bool AudioStreamOutALSA::renderLoop()
+{
+    {
+        AutoMutex lock(mLock);
+        snd_pcm_t *h = mHandle->handle;
+        if (!h || !mRenderCallback) return false;
+
+        // Sleeps until avail_min, one period, is free or the PCM needs
+        // help. mLock is held, as by a blocking write(), so that nothing
+        // closes or reopens the PCM meanwhile; the timeout lets others in.
+        int timeout = mHandle->sampleRate ?
+            (int)(2 * mHandle->periodSize * 1000 / mHandle->sampleRate) : 0;
+        if (timeout <= 0 || timeout > RENDER_TIMEOUT_MS) timeout = RENDER_TIMEOUT_MS;
+
+        if (snd_pcm_wait(h, timeout) == 0) return true;
+    }
+
+    return render(0);
+}
+
+//
+// Ask the client for all the room there is in the PCM, in whole periods
+// and no more than 'limit' frames unless that is 0, and write it. Returns
+// false if the PCM cannot be recovered. The callback runs without mLock
+// held; the PCM is only touched with it held, and the one the callback
+// was asked for is checked again afterwards, as the route may have
+// changed or the buffer been resized meanwhile.
+//
+bool AudioStreamOutALSA::render(snd_pcm_uframes_t limit)
+{
+    snd_pcm_t *h;
+    snd_pcm_uframes_t bufferSize, periodSize;
+    snd_pcm_uframes_t frames;
+    size_t frameSize;
+    render_callback_t callback;
+    void *cookie;
+    char *buffer;
+    int64_t position;
+    nsecs_t time;
+    int err;
+
+    {
+        AutoMutex lock(mLock);
+        h = mHandle->handle;
+        if (!h || !mRenderCallback) return false;
+        if (snd_pcm_get_params(h, &bufferSize, &periodSize) < 0 || !periodSize) return false;
+
+        acoustic_device_t *aDev = acoustics();
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(h);
+
+        if (avail < 0) {
+            if (avail == -EPIPE) {
+                LOGD("INFO: EPIPE\n");
+                if (adaptXrun()) {
+                    if (aDev && aDev->recover) aDev->recover(aDev, 0);
+                    return mHandle->handle != NULL;
+                }
+            }
+            err = snd_pcm_recover(h, avail, 1);
+            if (aDev && aDev->recover) aDev->recover(aDev, err);
+            if (err < 0) {
+                LOGE("Render callback stopped: %s", snd_strerror(err));
+                return false;
+            }
+            return true;
+        }
+
+        frames = avail;
+        if (limit && frames > limit) frames = limit;
+        frames -= frames % periodSize;
+        if (frames > mRenderFrames) frames = mRenderFrames - mRenderFrames % periodSize;
+        if (!frames) return true;
+
+        snd_pcm_sframes_t delay;
+
+        if (snd_pcm_delay(h, &delay) < 0) delay = 0;
+        time = systemTime(SYSTEM_TIME_MONOTONIC) +
+               (nsecs_t)delay * 1000000000LL / mHandle->sampleRate;
+        position = mFramesWritten;
+        frameSize = snd_pcm_frames_to_bytes(h, 1);
+        callback = mRenderCallback;
+        cookie = mRenderCookie;
+        buffer = mRender;
+    }
+
+    // mRender only changes once the render thread is stopped, or duplex
+    // mode left, which waits for the capture thread to be out of here.
+    size_t rendered = callback(cookie, buffer, frames, position, time);
+    if (rendered < frames)
+        memset(buffer + rendered * frameSize, 0, (frames - rendered) * frameSize);
+
+    AutoMutex lock(mLock);
+    acoustic_device_t *aDev = acoustics();
+
+    if (mHandle->handle != h) return true;
+
+    if (aDev && aDev->timestamp)
+        aDev->timestamp(aDev, SND_PCM_STREAM_PLAYBACK, position, time);
+
+    mWrites++;
+    mStatFrames += frames;
+
+    // Timed commands split the period at their frames, as in write().
+    const char *data = buffer;
+    runCommands(mFramesWritten);
+
+    while (frames && mHandle->handle == h) {
+        snd_pcm_uframes_t segment = frames;
+
+        if (!mCommands.isEmpty() && mCommands[0].frame < mFramesWritten + (int64_t)frames)
+            segment = mCommands[0].frame - mFramesWritten;
+
+        const char *out = applyGain(data, segment);
+        if (aDev && aDev->write)
+            aDev->write(aDev, out, segment * frameSize);
+
+        ssize_t n = writeFrames(out, segment);
+        if (n <= 0) break;
+
+        mFramesWritten += n;
+        data += n * frameSize;
+        frames -= n;
+
+        runCommands(mFramesWritten);
+    }
+
+    // A route that came due while linked needs the capture to let go. This
+    // is the thread rendering for it, so asking only leaves a note.
+    if (mRouteDeferred && mRenderThread == NULL) mParent->mCapture->unlink(this);
+
+    return true;
+}
+
+//
+// Hand 'frames' frames to the PCM, recovering from errors on the way.
+// Returns the number of frames written, or a negative error.
+//
+ssize_t AudioStreamOutALSA::writeFrames(const char *data, snd_pcm_uframes_t frames)
+{
+    acoustic_device_t *aDev = acoustics();
     snd_pcm_sframes_t n;
-    size_t            sent = 0;
-    status_t          err;
+    snd_pcm_uframes_t sent = 0;
+
+    if (mSwitchArmed) {
+        int state = mSwitch->state();
+
+        if (state == SWITCH_READY) return crossfade(data, frames);
+
+        if (state == SWITCH_FAILED) {
+            cancelSwitch(true);
+            if (!mHandle->handle) return NO_INIT;
+        }
+    }
 
     do {
+        // The call sleeps until avail_min frames are free, as many times
+        // as it takes to make room.
+        snd_pcm_uframes_t availMin = mAvailMin ? mAvailMin : mHandle->periodSize;
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(mHandle->handle);
+        if (avail >= 0 && (snd_pcm_uframes_t)avail < frames - sent && availMin)
+            mWakeups += (frames - sent - avail + availMin - 1) / availMin;
+
+        // How much was left to play when the write came.
+        if (avail >= 0 && mAdaptive && snd_pcm_state(mHandle->handle) == SND_PCM_STATE_RUNNING)
+            adaptSlack((snd_pcm_sframes_t)mHandle->bufferSize - avail);
+
+        mSyscalls++;
+
         n = snd_pcm_writei(mHandle->handle,
-                           (char *)buffer + sent,
-                           snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent));
+                           data + snd_pcm_frames_to_bytes(mHandle->handle, sent),
+                           frames - sent);
         if (n < 0) {
             if (n == -EBADFD) {
                 /* if there is such a problem, re-open the device to recover,
@@ -107,7 +1126,7 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
                 LOGE("ERROR EBADFD\n");
                 mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
                 if (aDev && aDev->recover) aDev->recover(aDev, n);
-                if (n) return static_cast<ssize_t>(n);
+                return n;
             }
             else if (mHandle->handle) {
                 // snd_pcm_recover() will return 0 if successful in recovering from
@@ -118,27 +1137,433 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
                     should only see this during the specific case
                     where we are waiting for standby*/
                     LOGD("INFO: EPIPE\n");
+
+                    // The PCM has stopped anyway; this is the time to grow it.
+                    if (adaptXrun()) {
+                        if (aDev && aDev->recover) aDev->recover(aDev, 0);
+                        continue;
+                    }
                 }
                 n = snd_pcm_recover(mHandle->handle, n, 1);
 
+                if (aDev && aDev->recover) aDev->recover(aDev, n);
 
-		if (aDev && aDev->recover) aDev->recover(aDev, n);
-
-                if (n) return static_cast<ssize_t>(n);
+                if (n) return n;
             }
         }
         else {
-            sent += static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
-            framesRendered += sent;
+            sent += n;
+            framesRendered += n;
         }
 
-    } while (mHandle->handle && sent < bytes);
+    } while (mHandle->handle && sent < frames);
 
     return sent;
 }
 
+//
+// Start opening the PCM for 'device' in the background, unless that is
+// already under way. Returns false if the route cannot change that way.
+// Called with mLock held.
+//
+bool AudioStreamOutALSA::startSwitch(uint32_t device)
+{
+    if (mSwitch != NULL) {
+        if (mSwitch->device() == device) return true;
+        cancelSwitch(false);
+    }
+
+    int mode = mParent->mode();
+
+    if (!mSeamless || !mHandle->handle || mWarmStandby) return false;
+
+    // Draining the old PCM would stop the capture linked to it.
+    if (mRenderCallback && mRenderThread == NULL) return false;
+    if (mHandle->curDev == device && mHandle->curMode == mode) return false;
+
+    mSwitch = new ALSASwitchThread(*mHandle, device, mode);
+    if (mSwitch->run("ALSASwitch", ANDROID_PRIORITY_AUDIO) != NO_ERROR) {
+        mSwitch.clear();
+        return false;
+    }
+
+    mSwitchArmed = false;
+
+    return true;
+}
+
+//
+// Stop the switch thread. If routeNow() has already committed the stream
+// to its device and 'apply' is set, route there now, with a gap, rather
+// than lose the route. Called with mLock held.
+//
+void AudioStreamOutALSA::cancelSwitch(bool apply)
+{
+    if (mSwitch == NULL) return;
+
+    uint32_t device = mSwitch->device();
+    bool armed = mSwitchArmed;
+
+    mSwitch->cancel();
+    mSwitch.clear();
+    mSwitchArmed = false;
+
+    if (apply && armed)
+        mParent->mALSADevice->route(mHandle, device, mParent->mode());
+}
+
+//
+// Route to 'device' from the next frame written: crossfading to a PCM
+// opened in the background, once it is open, or closing the old one and
+// opening the new one. A PCM linked to the capture cannot be drained
+// without stopping the capture too, so the route is deferred until the
+// capture lets go; unlinking takes the capture lock, which comes before
+// ours, so that is left to the caller, once it has let go of mLock.
+// Called with mLock held.
+//
+status_t AudioStreamOutALSA::routeNow(uint32_t device)
+{
+    if (mRenderCallback && mRenderThread == NULL) {
+        mRouteDeferred = true;
+        mDeferredRoute = device;
+        return NO_ERROR;
+    }
+
+    // What is staged belongs to the old route.
+    if (mStaged && mHandle->handle && !mWarmStandby)
+        writeFrames(mStage, mStaged);
+    mStaged = 0;
+
+    if (startSwitch(device)) {
+        mSwitchArmed = true;
+        return NO_ERROR;
+    }
+
+    return mParent->mALSADevice->route(mHandle, device, mParent->mode());
+}
+
+//
+// Switch to the PCM the switch thread opened. The new PCM is started with
+// as much silence as the old one still has to play, so that the first
+// frames of 'data', faded out on the old PCM and in on the new one, play
+// on both at once. The old PCM is then left to the thread to drain and
+// close. Called with mLock held.
+//
+ssize_t AudioStreamOutALSA::crossfade(const char *data, snd_pcm_uframes_t frames)
+{
+    snd_pcm_t *old = mHandle->handle;
+    alsa_handle_t next = mSwitch->next();
+    snd_pcm_uframes_t bufferSize, periodSize;
+    snd_pcm_sframes_t delay;
+
+    if (!old || snd_pcm_delay(old, &delay) < 0 || delay < 0) delay = 0;
+    if (snd_pcm_get_params(next.handle, &bufferSize, &periodSize) < 0) bufferSize = next.bufferSize;
+    if ((snd_pcm_uframes_t)delay + frames > bufferSize)
+        delay = bufferSize > frames ? bufferSize - frames : 0;
+
+    snd_pcm_uframes_t fade = frames < mCrossfadeFrames ? frames : mCrossfadeFrames;
+    size_t fadeBytes = snd_pcm_frames_to_bytes(old ? old : next.handle, fade);
+    size_t zeroBytes = snd_pcm_frames_to_bytes(next.handle, delay);
+    char *buffer = (char *)calloc(1, (fadeBytes > zeroBytes ? fadeBytes : zeroBytes) + fadeBytes);
+    bool ramps = buffer && mHandle->format == SND_PCM_FORMAT_S16_LE;
+
+    if (buffer && delay) {
+        snd_pcm_writei(next.handle, buffer, delay);
+        snd_pcm_start(next.handle);
+    }
+
+    if (old && ramps) {
+        ramp((int16_t *)buffer, (const int16_t *)data, fade, mHandle->channels, 1.0f, 0.0f);
+        snd_pcm_writei(old, buffer, fade);
+    }
+
+    alsa_handle_t retired = *mHandle;
+    mSwitch->retire(retired);
+    mSwitch.clear();
+    mSwitchArmed = false;
+
+    *mHandle = next;
+
+    LOGI("Crossfaded to 0x%08x over %u frames, %ld frames in", next.curDev,
+         (unsigned int)fade, (long)delay);
+
+    // The rest goes the usual way, to the new PCM.
+    ssize_t n = 0;
+    if (ramps) {
+        ramp((int16_t *)buffer, (const int16_t *)data, fade, mHandle->channels, 0.0f, 1.0f);
+        n = writeFrames(buffer, fade);
+    } else
+        fade = 0;
+
+    free(buffer);
+
+    if (n < 0) return n;
+    if (fade == frames) return n;
+
+    ssize_t rest = writeFrames(data + snd_pcm_frames_to_bytes(mHandle->handle, fade),
+                               frames - fade);
+    return rest < 0 ? rest : n + rest;
+}
+
+//
+// Count an underrun, and grow the buffer when there have been
+// alsa.output.adaptive.xruns of them within alsa.output.adaptive.window_ms.
+// Returns true if the PCM was reopened for a bigger buffer. Called with
+// mLock held, the PCM stopped.
+//
+bool AudioStreamOutALSA::adaptXrun()
+{
+    if (!mAdaptive) return false;
+
+    // A linked duplex PCM keeps its configuration.
+    if (mRenderCallback && mRenderThread == NULL) return false;
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    mXruns++;
+    mPendingLatency = 0;
+    mStableSince = now;
+    mMinSlack = mHandle->bufferSize;
+
+    if (now - mWindowStart > mXrunWindow) {
+        mWindowStart = now;
+        mWindowXruns = 0;
+    }
+
+    if (++mWindowXruns < mGrowXruns) return false;
+
+    unsigned int latency = mHandle->latency * 2;
+    if (latency > mMaxLatency) latency = mMaxLatency;
+    if (latency <= mHandle->latency) return false;
+
+    mWindowXruns = 0;
+
+    // Each growth makes the next shrink wait one stable period longer.
+    if (mShrinkHold < 4) mShrinkHold++;
+
+    // Reopened either way; a failure leaves the handle closed, as with
+    // any reopen here.
+    resize(latency, "repeated underruns");
+
+    return true;
+}
+
+//
+// Keep the least slack seen, and once the output has gone
+// alsa.output.adaptive.stable_s without an underrun and without coming
+// within a quarter of the buffer of one, ask for a quarter less buffer at
+// the next gap in the sound. Called with mLock held.
+//
+void AudioStreamOutALSA::adaptSlack(snd_pcm_sframes_t slack)
+{
+    if (slack < mMinSlack) mMinSlack = slack;
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (now - mStableSince < mStableTime) return;
+
+    unsigned int latency = mHandle->latency * 3 / 4;
+
+    if (mShrinkHold)
+        mShrinkHold--;
+    else if (!mPendingLatency && latency >= mMinLatency &&
+             mMinSlack > (snd_pcm_sframes_t)(mHandle->bufferSize / 4)) {
+        mPendingLatency = latency;
+        LOGV("Output buffer to shrink to %u us, least slack %ld frames", latency, mMinSlack);
+    }
+
+    mStableSince = now;
+    mMinSlack = mHandle->bufferSize;
+}
+
+//
+// Ask for 'latency' us of buffer from the next open on, reopening the PCM
+// now if it is open. Called with mLock held.
+//
+status_t AudioStreamOutALSA::resize(unsigned int latency, const char *reason)
+{
+    unsigned int before = mHandle->latency;
+    unsigned int frames = mHandle->bufferSize;
+    status_t err = NO_ERROR;
+
+    mPendingLatency = 0;
+    mHandle->latency = latency;
+    mHandle->bufferSize = (uint64_t)latency * mHandle->sampleRate / 1000000;
+
+    if (mHandle->handle)
+        err = mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
+
+    mResizes++;
+    mStableSince = systemTime(SYSTEM_TIME_MONOTONIC);
+    mMinSlack = mHandle->bufferSize;
+
+    LOGI("Output buffer %u -> %u frames (%u -> %u us, period %u) after %s",
+         frames, mHandle->bufferSize, before, mHandle->latency, mHandle->periodSize, reason);
+
+    return err;
+}
+
+//
+// The staging buffer holds less than a period. Called with mLock held.
+//
+bool AudioStreamOutALSA::prepareStage(snd_pcm_uframes_t period)
+{
+    if (mStage && mStagePeriod == period) return true;
+
+    // The period changed with the PCM; what was staged for the old one is
+    // dropped.
+    free(mStage);
+    mStage = (char *)malloc(snd_pcm_frames_to_bytes(mHandle->handle, period));
+    mStagePeriod = mStage ? period : 0;
+    mStaged = 0;
+
+    return mStage != NULL;
+}
+
+//
+// With whole-period writes, the driver need not wake us for every period:
+// only once there is room for a whole write, or for half the buffer if
+// that is less, to keep a safe margin. The sw params are read back on
+// every write, which costs no system call, so that this follows the PCM
+// through reopens. Called with mLock held.
+//
+void AudioStreamOutALSA::setWakeup()
+{
+    snd_pcm_t *h = mHandle->handle;
+    snd_pcm_uframes_t bufferSize, periodSize, availMin;
+
+    if (!h || snd_pcm_get_params(h, &bufferSize, &periodSize) < 0 || !periodSize) return;
+    if (!mSwParams && snd_pcm_sw_params_malloc(&mSwParams) < 0) {
+        mSwParams = NULL;
+        return;
+    }
+
+    size_t periods = this->bufferSize() / snd_pcm_frames_to_bytes(h, periodSize);
+    if (periods > bufferSize / periodSize / 2) periods = bufferSize / periodSize / 2;
+    if (!periods) periods = 1;
+
+    if (snd_pcm_sw_params_current(h, mSwParams) < 0 ||
+        snd_pcm_sw_params_get_avail_min(mSwParams, &availMin) < 0)
+        return;
+
+    mAvailMin = availMin;
+    if (availMin == periods * periodSize) return;
+
+    if (snd_pcm_sw_params_set_avail_min(h, mSwParams, periods * periodSize) < 0 ||
+        snd_pcm_sw_params(h, mSwParams) < 0) {
+        LOGW("Unable to wake for %u periods at a time", periods);
+        return;
+    }
+
+    mAvailMin = periods * periodSize;
+
+    LOGV("Output wakes for %u periods of %u frames at a time", periods, (unsigned int)periodSize);
+}
+
+size_t AudioStreamOutALSA::bufferSize() const
+{
+    snd_pcm_uframes_t bufferSize = mHandle->bufferSize;
+    snd_pcm_uframes_t periodSize = mHandle->periodSize;
+
+    if (mHandle->handle) snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
+
+    size_t bytes = ALSAStreamOps::bufferSize();
+    if (!periodSize || !mHandle->handle) return bytes;
+
+    // As many whole periods as fit the size we used to report, so that
+    // every write the mixer makes ends on a period boundary.
+    size_t period = snd_pcm_frames_to_bytes(mHandle->handle, periodSize);
+    size_t periods = bytes / period;
+
+    return (periods ? periods : 1) * period;
+}
+
+//
+// Stop the PCM, which is only playing silence, but keep it configured so
+// that the next sound can start it straight away. Called with mLock held.
+//
+void AudioStreamOutALSA::enterWarmStandby()
+{
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(mHandle->handle, &delay) < 0) delay = 0;
+
+    snd_pcm_drop(mHandle->handle);
+    mStaged = 0;
+
+    // Writes are due when the hardware would have had room for them.
+    mSilenceClock = systemTime(SYSTEM_TIME_MONOTONIC) +
+        (nsecs_t)delay * 1000000000LL / mHandle->sampleRate;
+    mWarmStandby = true;
+
+    if (mPowerLock) {
+        release_wake_lock ("AudioOutLock");
+        mPowerLock = false;
+    }
+
+    LOGV("Output silent for %u frames, in warm standby", mSilentFrames);
+}
+
+status_t AudioStreamOutALSA::leaveWarmStandby()
+{
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    mWarmStandby = false;
+
+    if (!mPowerLock) {
+        acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
+        mPowerLock = true;
+    }
+
+    // A smaller buffer, if one is due, costs nothing now.
+    if (mPendingLatency) return resize(mPendingLatency, "stable output");
+
+    // Stopped with its configuration, the PCM only needs preparing; it
+    // starts again once the writes have filled it.
+    int err = snd_pcm_prepare(mHandle->handle);
+    if (err < 0) {
+        LOGE("Unable to leave warm standby: %s", snd_strerror(err));
+        return mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
+    }
+
+    acoustic_device_t *aDev = acoustics();
+    if (aDev && aDev->recover) aDev->recover(aDev, 0);
+
+    LOGV("Output left warm standby in %lld us", ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+
+    return NO_ERROR;
+}
+
 status_t AudioStreamOutALSA::dump(int fd, const Vector<String16>& args)
 {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    AutoMutex lock(mLock);
+
+    snprintf(buffer, SIZE, "Output: %u Hz, period %u frames, writes of %u bytes, staging %s%s%s\n",
+             mHandle->sampleRate, (unsigned int)mHandle->periodSize, (unsigned int)bufferSize(),
+             mStaging ? "on" : "off", mWarmStandby ? ", in warm standby" : "",
+             !mRenderCallback ? "" : mRenderThread != NULL ? ", render callback" :
+             ", render callback in duplex");
+    result.append(buffer);
+
+    if (mStatFrames) {
+        uint64_t rate = mHandle->sampleRate;
+        snprintf(buffer, SIZE, "  per second: %llu writes, %llu writei calls, %llu wakeups\n",
+                 mWrites * rate / mStatFrames, mSyscalls * rate / mStatFrames,
+                 mWakeups * rate / mStatFrames);
+        result.append(buffer);
+    }
+
+    if (mAdaptive) {
+        snprintf(buffer, SIZE, "  buffer %u frames, %u us; %u underruns, %u resizes%s\n",
+                 mHandle->bufferSize, mHandle->latency, mXruns, mResizes,
+                 mPendingLatency ? ", shrinking at the next gap" : "");
+        result.append(buffer);
+    }
+
+    ::write(fd, result.string(), result.size());
+
     return NO_ERROR;
 }
 
@@ -150,10 +1575,17 @@ status_t AudioStreamOutALSA::open(int mode)
 
 status_t AudioStreamOutALSA::close()
 {
+    stopRender();
+
     AutoMutex lock(mLock);
 
     snd_pcm_drain (mHandle->handle);
     framesRendered = 0;
+    mSilentFrames = 0;
+    mWarmStandby = false;
+    mStaged = 0;
+    mCommands.clear();
+    cancelSwitch(false);
     ALSAStreamOps::close();
 
     if (mPowerLock) {
@@ -166,8 +1598,23 @@ status_t AudioStreamOutALSA::close()
 
 status_t AudioStreamOutALSA::standby()
 {
+    stopRender();
+
     AutoMutex lock(mLock);
 
+    // Nothing is left to wait for.
+    if (!mCommands.isEmpty()) runCommands(mCommands[mCommands.size() - 1].frame);
+    mStartTime = 0;
+
+    // A route the thread had no time to open is made the slow way, so
+    // that the stream comes out of standby on it.
+    cancelSwitch(true);
+
+    // Play out what is staged.
+    if (mStaged && mHandle->handle && !mWarmStandby)
+        snd_pcm_writei(mHandle->handle, mStage, mStaged);
+    mStaged = 0;
+
     snd_pcm_drain (mHandle->handle);
 
     /* save state of mHandle->handle so we can re-use it
@@ -179,8 +1626,19 @@ status_t AudioStreamOutALSA::standby()
 
     /* now close it so we can reach off while idle */
     LOGE("CALLING STANDBY\n");
+    uint32_t device = mHandle->curDev;
+    int mode = mHandle->curMode;
     mHandle->module->close(mHandle);
+
+    // write() reopens where the stream was routed last.
+    mHandle->curDev = device;
+    mHandle->curMode = mode;
+
+    // The next open is a gap anyway.
+    if (mPendingLatency) resize(mPendingLatency, "stable output");
     framesRendered = 0;
+    mSilentFrames = 0;
+    mWarmStandby = false;
     if (mPowerLock) {
         release_wake_lock ("AudioOutLock");
         mPowerLock = false;
@@ -15,8 +15,20 @@
  ** limitations under the License.
  */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
 #define LOG_TAG "AcousticsModule"
 #include <utils/Log.h>
+#include <utils/Timers.h>
+
+#include <cutils/properties.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 #include "AudioHardwareALSA.h"
 
@@ -31,6 +43,13 @@ static status_t s_cleanup(acoustic_device_t *);
 static status_t s_set_params(acoustic_device_t *,
         AudioSystem::audio_in_acoustics, void *params);
 
+static ssize_t s_read(acoustic_device_t *, void *, size_t);
+static ssize_t s_write(acoustic_device_t *, const void *, size_t);
+static status_t s_recover(acoustic_device_t *, int);
+static void s_timestamp(acoustic_device_t *, snd_pcm_stream_t, int64_t, nsecs_t);
+static ssize_t s_process(acoustic_device_t *, void *, size_t);
+static int s_activity(acoustic_device_t *);
+
 static hw_module_methods_t s_module_methods = {
     open            : s_device_open
 };
@@ -47,6 +66,1318 @@ extern "C" const hw_module_t HAL_MODULE_INFO_SYM = {
     reserved        : { 0, },
 };
 
+// ----------------------------------------------------------------------------
+
+//
+// Radix-2 complex FFT on split real and imaginary arrays. The first two
+// stages run as one radix-4 pass, and the later ones four butterflies at
+// a time with NEON, on twiddles laid out stage by stage.
+//
+struct fft_t {
+    int                 size;
+    int *               rev;
+    float *             cos;        // size, stage with span s from s on
+    float *             sin;
+};
+
+static void fft_destroy(fft_t *fft)
+{
+    if (!fft) return;
+
+    free(fft->rev);
+    free(fft->cos);
+    free(fft->sin);
+    free(fft);
+}
+
+static fft_t *fft_create(int size)
+{
+    fft_t *fft = (fft_t *)calloc(1, sizeof(*fft));
+    if (!fft) return NULL;
+
+    fft->size = size;
+    fft->rev = (int *)malloc(size * sizeof(int));
+    fft->cos = (float *)malloc(size * sizeof(float));
+    fft->sin = (float *)malloc(size * sizeof(float));
+
+    if (!fft->rev || !fft->cos || !fft->sin) {
+        fft_destroy(fft);
+        return NULL;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < size) bits++;
+
+    for (int i = 0; i < size; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        fft->rev[i] = r;
+    }
+
+    for (int span = 1; span < size; span <<= 1)
+        for (int j = 0; j < span; j++) {
+            fft->cos[span + j] = cosf(M_PI * j / span);
+            fft->sin[span + j] = sinf(M_PI * j / span);
+        }
+
+    return fft;
+}
+
+static void fft_run(const fft_t *fft, float *re, float *im, bool inverse)
+{
+    int size = fft->size;
+
+    for (int i = 0; i < size; i++) {
+        int r = fft->rev[i];
+        if (r > i) {
+            float t = re[i]; re[i] = re[r]; re[r] = t;
+            t = im[i]; im[i] = im[r]; im[r] = t;
+        }
+    }
+
+    float sign = inverse ? 1.0f : -1.0f;
+    int span = 1;
+
+    // Spans 1 and 2 together; their twiddles are 1 and sign * i.
+    if (size >= 4) {
+        for (int i = 0; i < size; i += 4) {
+            float r0 = re[i] + re[i + 1], i0 = im[i] + im[i + 1];
+            float r1 = re[i] - re[i + 1], i1 = im[i] - im[i + 1];
+            float r2 = re[i + 2] + re[i + 3], i2 = im[i + 2] + im[i + 3];
+            float tr = -sign * (im[i + 2] - im[i + 3]);
+            float ti = sign * (re[i + 2] - re[i + 3]);
+
+            re[i] = r0 + r2;        im[i] = i0 + i2;
+            re[i + 2] = r0 - r2;    im[i + 2] = i0 - i2;
+            re[i + 1] = r1 + tr;    im[i + 1] = i1 + ti;
+            re[i + 3] = r1 - tr;    im[i + 3] = i1 - ti;
+        }
+        span = 4;
+    }
+
+    for (; span < size; span <<= 1) {
+        const float *wr = fft->cos + span;
+        const float *ws = fft->sin + span;
+
+        for (int i = 0; i < size; i += span * 2) {
+            float *ar = re + i, *ai = im + i;
+            float *br = ar + span, *bi = ai + span;
+
+#ifdef __ARM_NEON__
+            for (int j = 0; span >= 4 && j < span; j += 4) {
+                float32x4_t cr = vld1q_f32(wr + j);
+                float32x4_t ci = vmulq_n_f32(vld1q_f32(ws + j), sign);
+                float32x4_t xr = vld1q_f32(br + j), xi = vld1q_f32(bi + j);
+                float32x4_t yr = vld1q_f32(ar + j), yi = vld1q_f32(ai + j);
+
+                float32x4_t tr = vmlsq_f32(vmulq_f32(xr, cr), xi, ci);
+                float32x4_t ti = vmlaq_f32(vmulq_f32(xr, ci), xi, cr);
+
+                vst1q_f32(br + j, vsubq_f32(yr, tr));
+                vst1q_f32(bi + j, vsubq_f32(yi, ti));
+                vst1q_f32(ar + j, vaddq_f32(yr, tr));
+                vst1q_f32(ai + j, vaddq_f32(yi, ti));
+            }
+            if (span >= 4) continue;
+#endif
+            for (int j = 0; j < span; j++) {
+                float cr = wr[j];
+                float ci = sign * ws[j];
+
+                float tr = br[j] * cr - bi[j] * ci;
+                float ti = br[j] * ci + bi[j] * cr;
+
+                br[j] = ar[j] - tr;
+                bi[j] = ai[j] - ti;
+                ar[j] += tr;
+                ai[j] += ti;
+            }
+        }
+    }
+
+    if (inverse) {
+        float scale = 1.0f / size;
+        for (int i = 0; i < size; i++) {
+            re[i] *= scale;
+            im[i] *= scale;
+        }
+    }
+}
+
+//
+// Inverse transform of a real signal given by its first size / 2 + 1 bins.
+//
+static void fft_inverse_real(const fft_t *fft, float *re, float *im)
+{
+    int size = fft->size;
+
+    for (int k = size / 2 + 1; k < size; k++) {
+        re[k] = re[size - k];
+        im[k] = -im[size - k];
+    }
+
+    fft_run(fft, re, im, true);
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Spectral kernels over 'count' bins, a multiple of four.
+//
+
+// y += x * w
+static void spectrum_mac(float *yr, float *yi,
+                         const float *xr, const float *xi,
+                         const float *wr, const float *wi, int count)
+{
+#ifdef __ARM_NEON__
+    for (int k = 0; k < count; k += 4) {
+        float32x4_t ar = vld1q_f32(xr + k), ai = vld1q_f32(xi + k);
+        float32x4_t br = vld1q_f32(wr + k), bi = vld1q_f32(wi + k);
+        float32x4_t sr = vld1q_f32(yr + k), si = vld1q_f32(yi + k);
+
+        sr = vmlaq_f32(sr, ar, br);
+        sr = vmlsq_f32(sr, ai, bi);
+        si = vmlaq_f32(si, ar, bi);
+        si = vmlaq_f32(si, ai, br);
+
+        vst1q_f32(yr + k, sr);
+        vst1q_f32(yi + k, si);
+    }
+#else
+    for (int k = 0; k < count; k++) {
+        yr[k] += xr[k] * wr[k] - xi[k] * wi[k];
+        yi[k] += xr[k] * wi[k] + xi[k] * wr[k];
+    }
+#endif
+}
+
+// w += conj(x) * g
+static void spectrum_update(float *wr, float *wi,
+                            const float *xr, const float *xi,
+                            const float *gr, const float *gi, int count)
+{
+#ifdef __ARM_NEON__
+    for (int k = 0; k < count; k += 4) {
+        float32x4_t ar = vld1q_f32(xr + k), ai = vld1q_f32(xi + k);
+        float32x4_t br = vld1q_f32(gr + k), bi = vld1q_f32(gi + k);
+        float32x4_t sr = vld1q_f32(wr + k), si = vld1q_f32(wi + k);
+
+        sr = vmlaq_f32(sr, ar, br);
+        sr = vmlaq_f32(sr, ai, bi);
+        si = vmlaq_f32(si, ar, bi);
+        si = vmlsq_f32(si, ai, br);
+
+        vst1q_f32(wr + k, sr);
+        vst1q_f32(wi + k, si);
+    }
+#else
+    for (int k = 0; k < count; k++) {
+        wr[k] += xr[k] * gr[k] + xi[k] * gi[k];
+        wi[k] += xr[k] * gi[k] - xi[k] * gr[k];
+    }
+#endif
+}
+
+// x *= g
+static void spectrum_scale(float *xr, float *xi, const float *g, int count)
+{
+#ifdef __ARM_NEON__
+    for (int k = 0; k < count; k += 4) {
+        float32x4_t gain = vld1q_f32(g + k);
+
+        vst1q_f32(xr + k, vmulq_f32(vld1q_f32(xr + k), gain));
+        vst1q_f32(xi + k, vmulq_f32(vld1q_f32(xi + k), gain));
+    }
+#else
+    for (int k = 0; k < count; k++) {
+        xr[k] *= g[k];
+        xi[k] *= g[k];
+    }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Partitioned block frequency domain NLMS echo canceller (overlap-save).
+// The echo path is modelled by 'parts' filters of one block each; one
+// partition per block is constrained back to a linear convolution.
+//
+struct aec_t {
+    int                 block;
+    int                 size;       // FFT size, two blocks
+    int                 bins;       // size / 2 + 1
+    int                 stride;     // bins, rounded up for the kernels
+    int                 parts;
+    int                 head;       // partition of the newest far-end spectrum
+    int                 constrain;
+    float               mu;
+
+    fft_t *             fft;
+
+    float *             xr;         // parts * stride far-end spectra
+    float *             xi;
+    float *             wr;         // parts * stride filter
+    float *             wi;
+    float *             power;      // far-end power per bin
+    float *             gr;         // step for this block
+    float *             gi;
+    float *             re;         // FFT work, size
+    float *             im;
+    float *             far;        // last two far-end blocks
+};
+
+static void aec_destroy(aec_t *aec)
+{
+    if (!aec) return;
+
+    fft_destroy(aec->fft);
+    free(aec->xr);
+    free(aec);
+}
+
+static size_t aec_floats(aec_t *aec)
+{
+    return 4 * aec->parts * aec->stride + 3 * aec->stride + 3 * aec->size;
+}
+
+static aec_t *aec_create(int block, int parts)
+{
+    aec_t *aec = (aec_t *)calloc(1, sizeof(*aec));
+    if (!aec) return NULL;
+
+    aec->block = block;
+    aec->size = 2 * block;
+    aec->bins = block + 1;
+    aec->stride = (aec->bins + 3) & ~3;
+    aec->parts = parts;
+    aec->mu = 0.5f;
+
+    // One allocation for all of the arrays.
+    aec->fft = fft_create(aec->size);
+    aec->xr = (float *)calloc(aec_floats(aec), sizeof(float));
+
+    if (!aec->fft || !aec->xr) {
+        aec_destroy(aec);
+        return NULL;
+    }
+
+    size_t spectra = parts * aec->stride;
+
+    aec->xi = aec->xr + spectra;
+    aec->wr = aec->xi + spectra;
+    aec->wi = aec->wr + spectra;
+    aec->power = aec->wi + spectra;
+    aec->gr = aec->power + aec->stride;
+    aec->gi = aec->gr + aec->stride;
+    aec->re = aec->gi + aec->stride;
+    aec->im = aec->re + aec->size;
+    aec->far = aec->im + aec->size;
+
+    return aec;
+}
+
+static void aec_reset(aec_t *aec)
+{
+    memset(aec->xr, 0, aec_floats(aec) * sizeof(float));
+    aec->head = 0;
+    aec->constrain = 0;
+}
+
+//
+// Cancel the echo of 'far' from 'near', one block each, in place. Without
+// 'adapt' the filter is applied but not trained.
+//
+static void aec_process(aec_t *aec, const float *far, float *near, bool adapt)
+{
+    int block = aec->block, size = aec->size;
+    int stride = aec->stride, bins = aec->bins;
+    float *re = aec->re, *im = aec->im;
+
+    // Spectrum of the last two far-end blocks, as the newest partition.
+    memmove(aec->far, aec->far + block, block * sizeof(float));
+    memcpy(aec->far + block, far, block * sizeof(float));
+
+    memcpy(re, aec->far, size * sizeof(float));
+    memset(im, 0, size * sizeof(float));
+    fft_run(aec->fft, re, im, false);
+
+    aec->head = (aec->head + aec->parts - 1) % aec->parts;
+
+    float *xr = aec->xr + aec->head * stride;
+    float *xi = aec->xi + aec->head * stride;
+
+    memcpy(xr, re, bins * sizeof(float));
+    memcpy(xi, im, bins * sizeof(float));
+
+    for (int k = 0; k < bins; k++)
+        aec->power[k] = 0.9f * aec->power[k] + 0.1f * (xr[k] * xr[k] + xi[k] * xi[k]);
+
+    // Echo estimate.
+    memset(re, 0, stride * sizeof(float));
+    memset(im, 0, stride * sizeof(float));
+
+    for (int p = 0; p < aec->parts; p++) {
+        int x = (aec->head + p) % aec->parts;
+        spectrum_mac(re, im, aec->xr + x * stride, aec->xi + x * stride,
+                     aec->wr + p * stride, aec->wi + p * stride, stride);
+    }
+
+    fft_inverse_real(aec->fft, re, im);
+
+    for (int i = 0; i < block; i++)
+        near[i] -= re[block + i];
+
+    if (!adapt) return;
+
+    // Normalised step from the spectrum of the error.
+    memset(re, 0, block * sizeof(float));
+    memcpy(re + block, near, block * sizeof(float));
+    memset(im, 0, size * sizeof(float));
+    fft_run(aec->fft, re, im, false);
+
+    float norm = aec->mu / aec->parts;
+    for (int k = 0; k < bins; k++) {
+        float g = norm / (aec->power[k] + 1e-6f);
+        aec->gr[k] = re[k] * g;
+        aec->gi[k] = im[k] * g;
+    }
+
+    for (int p = 0; p < aec->parts; p++) {
+        int x = (aec->head + p) % aec->parts;
+        spectrum_update(aec->wr + p * stride, aec->wi + p * stride,
+                        aec->xr + x * stride, aec->xi + x * stride,
+                        aec->gr, aec->gi, stride);
+    }
+
+    // Keep one partition a linear convolution: no more than a block of taps.
+    int p = aec->constrain;
+    aec->constrain = (p + 1) % aec->parts;
+
+    float *wr = aec->wr + p * stride, *wi = aec->wi + p * stride;
+
+    memcpy(re, wr, bins * sizeof(float));
+    memcpy(im, wi, bins * sizeof(float));
+    fft_inverse_real(aec->fft, re, im);
+
+    memset(re + block, 0, block * sizeof(float));
+    memset(im, 0, size * sizeof(float));
+    fft_run(aec->fft, re, im, false);
+
+    memcpy(wr, re, bins * sizeof(float));
+    memcpy(wi, im, bins * sizeof(float));
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Spectral noise suppression: a per-bin Wiener-style gain against a noise
+// floor that tracks the minimum of the smoothed power, falling quickly and
+// rising slowly. Applied with sqrt-Hann windows at 50% overlap, which adds
+// a block of delay.
+//
+#define NS_LEARN_BLOCKS     4       // without speech, per noise update
+
+struct ns_t {
+    int                 block;
+    int                 size;
+    int                 bins;
+    int                 stride;
+    int                 frames;     // blocks seen, up to the first estimate
+    int                 bypassed;   // blocks without speech until the next learnt
+    float               floor;      // smallest gain
+
+    fft_t *             fft;
+
+    float *             window;     // size
+    float *             noise;      // stride
+    float *             psd;        // stride, smoothed power
+    float *             gain;       // stride
+    float *             prev;       // block, last input
+    float *             tail;       // block, second half of the last output
+    float *             re;         // size
+    float *             im;
+};
+
+static void ns_destroy(ns_t *ns)
+{
+    if (!ns) return;
+
+    fft_destroy(ns->fft);
+    free(ns->window);
+    free(ns);
+}
+
+static ns_t *ns_create(int block, float floor)
+{
+    ns_t *ns = (ns_t *)calloc(1, sizeof(*ns));
+    if (!ns) return NULL;
+
+    ns->block = block;
+    ns->size = 2 * block;
+    ns->bins = block + 1;
+    ns->stride = (ns->bins + 3) & ~3;
+    ns->floor = floor;
+
+    ns->fft = fft_create(ns->size);
+    ns->window = (float *)calloc(4 * ns->size + 3 * ns->stride, sizeof(float));
+
+    if (!ns->fft || !ns->window) {
+        ns_destroy(ns);
+        return NULL;
+    }
+
+    ns->noise = ns->window + ns->size;
+    ns->psd = ns->noise + ns->stride;
+    ns->gain = ns->psd + ns->stride;
+    ns->prev = ns->gain + ns->stride;
+    ns->tail = ns->prev + ns->block;
+    ns->re = ns->tail + ns->block;
+    ns->im = ns->re + ns->size;
+
+    for (int i = 0; i < ns->size; i++)
+        ns->window[i] = sqrtf(0.5f - 0.5f * cosf(2 * M_PI * i / ns->size));
+
+    return ns;
+}
+
+static void ns_reset(ns_t *ns)
+{
+    memset(ns->noise, 0, (3 * ns->stride + 2 * ns->block) * sizeof(float));
+    ns->frames = 0;
+    ns->bypassed = 0;
+}
+
+//
+// Transform the last block and the one in 'data', and fold their power
+// into the smoothed spectrum and the noise estimate. The first estimate is
+// the mean of 16 blocks without speech; after that the floor falls to the
+// power quickly and rises slowly, and only falls during speech.
+//
+static void ns_analyse(ns_t *ns, const float *data, bool speech)
+{
+    int block = ns->block, bins = ns->bins;
+    float *re = ns->re, *im = ns->im;
+
+    for (int i = 0; i < block; i++) {
+        re[i] = ns->prev[i] * ns->window[i];
+        re[block + i] = data[i] * ns->window[block + i];
+    }
+    memset(im, 0, ns->size * sizeof(float));
+
+    fft_run(ns->fft, re, im, false);
+
+    bool seeding = ns->frames < 16;
+
+    for (int k = 0; k < bins; k++) {
+        float power = re[k] * re[k] + im[k] * im[k];
+        float psd = ns->frames ? 0.7f * ns->psd[k] + 0.3f * power : power;
+        float noise = ns->noise[k];
+
+        ns->psd[k] = psd;
+
+        if (seeding) {
+            if (!speech) noise = (noise * ns->frames + psd) / (ns->frames + 1);
+        } else if (psd < noise)
+            noise = 0.8f * noise + 0.2f * psd;
+        else if (!speech)
+            noise *= 1.005f;
+
+        ns->noise[k] = noise;
+    }
+
+    if (seeding && !speech) ns->frames++;
+}
+
+//
+// Suppress the noise in one block, in place.
+//
+static void ns_process(ns_t *ns, float *data, bool speech)
+{
+    int block = ns->block, bins = ns->bins;
+    float *re = ns->re, *im = ns->im;
+
+    ns_analyse(ns, data, speech);
+    memcpy(ns->prev, data, block * sizeof(float));
+
+    for (int k = 0; k < bins; k++) {
+        float psd = ns->psd[k];
+
+        // The minimum sits well below the mean noise power.
+        float g = psd > 0 ? 1.0f - 3.0f * ns->noise[k] / psd : 0;
+        if (g < ns->floor) g = ns->floor;
+
+        ns->gain[k] = 0.5f * (ns->gain[k] + g);
+    }
+
+    spectrum_scale(re, im, ns->gain, ns->stride);
+    fft_inverse_real(ns->fft, re, im);
+
+    for (int i = 0; i < block; i++) {
+        data[i] = ns->tail[i] + re[i] * ns->window[i];
+        ns->tail[i] = re[block + i] * ns->window[block + i];
+    }
+}
+
+//
+// Stand-in for ns_process() on blocks without speech: the same one block
+// delay and overlap, at the floor gain throughout, without the inverse
+// transform. The noise estimate learns from one block in NS_LEARN_BLOCKS,
+// so that it follows the noise, not the speech.
+//
+static void ns_bypass(ns_t *ns, float *data)
+{
+    int block = ns->block;
+    float g = ns->floor;
+
+    if (ns->bypassed-- <= 0) {
+        ns->bypassed = NS_LEARN_BLOCKS - 1;
+        ns_analyse(ns, data, false);
+    }
+
+    for (int i = 0; i < block; i++) {
+        float x = data[i];
+        data[i] = ns->tail[i] + ns->prev[i] * g * ns->window[i] * ns->window[i];
+        ns->tail[i] = x * g * ns->window[block + i] * ns->window[block + i];
+        ns->prev[i] = x;
+    }
+
+    for (int k = 0; k < ns->bins; k++)
+        ns->gain[k] = g;
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Voice activity from block energy against a tracked floor, and the zero
+// crossing rate: voiced speech is loud and crosses zero rarely, hiss
+// crosses often. Loud enough blocks count whatever their crossing rate,
+// for fricatives. Speech is held for a while after it stops.
+//
+struct vad_t {
+    float               threshold;  // energy over the floor, power ratio
+    float               floor;
+    int                 hangover;   // blocks
+    int                 hold;
+    bool                speech;
+};
+
+static void vad_init(vad_t *vad, float thresholddB, int hangover)
+{
+    vad->threshold = powf(10, thresholddB / 10);
+    vad->floor = 0;
+    vad->hangover = hangover;
+    vad->hold = 0;
+    vad->speech = false;
+}
+
+// Energy and zero crossings of 'count' samples, a multiple of four.
+static float vad_measure(const float *data, int count, int *crossings)
+{
+    int i = 0, n = 0;
+    float sum = 0;
+
+#ifdef __ARM_NEON__
+    float32x4_t acc = vdupq_n_f32(0);
+    uint32x4_t cross = vdupq_n_u32(0);
+    float32x4_t zero = vdupq_n_f32(0);
+
+    // Each sample against the next one, which is one unaligned load away.
+    for (; i < count - 4; i += 4) {
+        float32x4_t x = vld1q_f32(data + i);
+        uint32x4_t sign = veorq_u32(vcltq_f32(x, zero), vcltq_f32(vld1q_f32(data + i + 1), zero));
+
+        acc = vmlaq_f32(acc, x, x);
+        cross = vsubq_u32(cross, sign);
+    }
+
+    float32x2_t s2 = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    uint32x2_t c2 = vadd_u32(vget_low_u32(cross), vget_high_u32(cross));
+
+    sum = vget_lane_f32(vpadd_f32(s2, s2), 0);
+    n = vget_lane_u32(vpadd_u32(c2, c2), 0);
+#endif
+
+    for (; i < count; i++) {
+        sum += data[i] * data[i];
+        if (i + 1 < count) n += (data[i] < 0) != (data[i + 1] < 0);
+    }
+
+    *crossings = n;
+    return sum;
+}
+
+static bool vad_process(vad_t *vad, const float *data, int count)
+{
+    int crossings;
+    float energy = vad_measure(data, count, &crossings) / count;
+
+    float rate = (float)crossings / (count - 1);
+
+    // The floor follows drops quickly and rises by about 5 dB a second.
+    if (!vad->floor || energy < vad->floor)
+        vad->floor = vad->floor ? 0.8f * vad->floor + 0.2f * energy : energy;
+    else
+        vad->floor *= 1.01f;
+
+    if (vad->floor < 1e-10f) vad->floor = 1e-10f;
+
+    float over = energy / vad->floor;
+    bool active = over > vad->threshold && (rate < 0.3f || over > 4 * vad->threshold);
+
+    if (active)
+        vad->hold = vad->hangover;
+    else if (vad->hold)
+        vad->hold--;
+
+    vad->speech = vad->hold > 0;
+    return vad->speech;
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Automatic gain control towards a target RMS level, with the gain ramped
+// across each block and held while the input is below the gate.
+//
+struct agc_t {
+    float               target;
+    float               maxGain;
+    float               gain;
+    float               level;
+};
+
+static void agc_init(agc_t *agc, float targetdB, float maxdB)
+{
+    agc->target = powf(10, targetdB / 20);
+    agc->maxGain = powf(10, maxdB / 20);
+    agc->gain = 1;
+    agc->level = 0;
+}
+
+static void agc_process(agc_t *agc, float *data, int count)
+{
+    float sum = 0;
+    for (int i = 0; i < count; i++) sum += data[i] * data[i];
+    float rms = sqrtf(sum / count);
+
+    // Fast attack, slow release.
+    agc->level = rms > agc->level ? 0.5f * (agc->level + rms) : 0.995f * agc->level + 0.005f * rms;
+
+    float gain = agc->gain;
+
+    if (agc->level > 0.001f) {
+        float wanted = agc->target / agc->level;
+        if (wanted > agc->maxGain) wanted = agc->maxGain;
+
+        // At most 0.5 dB up and 3 dB down per block.
+        if (wanted > gain * 1.0593f) wanted = gain * 1.0593f;
+        if (wanted < gain * 0.7079f) wanted = gain * 0.7079f;
+        gain = wanted;
+    }
+
+    float step = (gain - agc->gain) / count;
+    float g = agc->gain;
+
+    for (int i = 0; i < count; i++) {
+        g += step;
+        float v = data[i] * g;
+        data[i] = v > 1 ? 1 : v < -1 ? -1 : v;
+    }
+
+    agc->gain = gain;
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Biquad section, transposed direct form II. A single recursive section
+// on one channel is inherently serial, so it is left to the compiler.
+//
+struct biquad_t {
+    float               b0, b1, b2, a1, a2;
+    float               z1, z2;
+};
+
+static void biquad_highpass(biquad_t *bq, float freq, float rate, float q)
+{
+    float w0 = 2 * M_PI * freq / rate;
+    float alpha = sinf(w0) / (2 * q);
+    float c = cosf(w0);
+    float a0 = 1 + alpha;
+
+    bq->b0 = (1 + c) / 2 / a0;
+    bq->b1 = -(1 + c) / a0;
+    bq->b2 = (1 + c) / 2 / a0;
+    bq->a1 = -2 * c / a0;
+    bq->a2 = (1 - alpha) / a0;
+    bq->z1 = bq->z2 = 0;
+}
+
+static void biquad_run(biquad_t *bq, float *data, int count)
+{
+    float b0 = bq->b0, b1 = bq->b1, b2 = bq->b2, a1 = bq->a1, a2 = bq->a2;
+    float z1 = bq->z1, z2 = bq->z2;
+
+    for (int i = 0; i < count; i++) {
+        float x = data[i];
+        float y = b0 * x + z1;
+        z1 = b1 * x - a1 * y + z2;
+        z2 = b2 * x - a2 * y;
+        data[i] = y;
+    }
+
+    bq->z1 = z1;
+    bq->z2 = z2;
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Delay and sum beamformer. Every microphone is delayed so that sound from
+// the look direction lines up across the array, with a whole number of
+// samples and a windowed sinc for the fraction, and the array is averaged.
+//
+#define BEAM_TAPS           16
+#define BEAM_MAX_DELAY      64      // samples
+#define BEAM_HISTORY        (BEAM_MAX_DELAY + BEAM_TAPS)
+
+#define SPEED_OF_SOUND      343.0f  // m/s
+
+struct beam_t {
+    int                 count;
+    int                 delay[ACOUSTICS_MAX_MICS];
+    float               taps[ACOUSTICS_MAX_MICS][BEAM_TAPS];
+};
+
+// y += x * h, over 'count' samples, a multiple of four.
+static void beam_mac(float *y, const float *x, float h, int count)
+{
+#ifdef __ARM_NEON__
+    for (int i = 0; i < count; i += 4)
+        vst1q_f32(y + i, vmlaq_n_f32(vld1q_f32(y + i), vld1q_f32(x + i), h));
+#else
+    for (int i = 0; i < count; i++)
+        y[i] += x[i] * h;
+#endif
+}
+
+static void beam_steer(beam_t *beam, const acoustic_geometry_t *geometry, uint32_t rate)
+{
+    float lead[ACOUSTICS_MAX_MICS];
+    float first = 0;
+
+    beam->count = geometry->count;
+
+    // How much earlier than the origin each microphone hears the talker.
+    for (int m = 0; m < beam->count; m++) {
+        const float *p = geometry->position[m];
+        lead[m] = (p[0] * geometry->look[0] + p[1] * geometry->look[1] +
+                   p[2] * geometry->look[2]) / SPEED_OF_SOUND * rate;
+        if (!m || lead[m] < first) first = lead[m];
+    }
+
+    for (int m = 0; m < beam->count; m++) {
+        float d = lead[m] - first;
+        if (d > BEAM_MAX_DELAY) d = BEAM_MAX_DELAY;
+
+        beam->delay[m] = (int)d;
+
+        float frac = d - beam->delay[m];
+        float sum = 0;
+
+        // Centred on tap BEAM_TAPS / 2 - 1, which every microphone shares.
+        for (int k = 0; k < BEAM_TAPS; k++) {
+            float t = k - (BEAM_TAPS / 2 - 1) - frac;
+            float w = 0.5f + 0.5f * cosf(M_PI * t / (BEAM_TAPS / 2));
+            float v = fabsf(t) < 1e-6f ? 1 : sinf(M_PI * t) / (M_PI * t);
+
+            beam->taps[m][k] = fabsf(t) < BEAM_TAPS / 2 ? w * v : 0;
+            sum += beam->taps[m][k];
+        }
+
+        for (int k = 0; k < BEAM_TAPS; k++)
+            beam->taps[m][k] /= sum * beam->count;
+    }
+}
+
+//
+// 'mic' holds BEAM_HISTORY past samples then 'count' new ones for each
+// microphone, 'stride' apart; the history is moved along afterwards.
+//
+static void beam_run(const beam_t *beam, float *mic, int stride, float *out, int count)
+{
+    memset(out, 0, count * sizeof(float));
+
+    for (int m = 0; m < beam->count; m++) {
+        float *x = mic + m * stride;
+
+        for (int k = 0; k < BEAM_TAPS; k++)
+            beam_mac(out, x + BEAM_HISTORY - beam->delay[m] - k, beam->taps[m][k], count);
+
+        memmove(x, x + count, BEAM_HISTORY * sizeof(float));
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+enum {
+    STAGE_HPF,
+    STAGE_VAD,
+    STAGE_AEC,
+    STAGE_NS,
+    STAGE_AGC,
+    STAGE_COUNT
+};
+
+//
+// State of the module, in modPrivate. The capture side is set up by
+// use_handle() and torn down by cleanup(); the playback handle only gives
+// the format of the reference coming through write().
+//
+struct acoustics_t {
+    Mutex               lock;
+
+    alsa_handle_t *     capture;
+    alsa_handle_t *     playback;
+    uint32_t            flags;
+
+    // set_params() only records the new flags and the stages to start
+    // over; the processing thread applies them between blocks.
+    uint32_t            nextFlags;
+    uint32_t            resets;
+    volatile bool       update;
+
+    uint32_t            rate;
+    uint32_t            channels;
+    nsecs_t             time;       // capture time of the next frame read
+
+    // Capture is processed a block at a time, and delayed by one block.
+    int                 block;
+    int                 fill;
+    float *             work;
+    float *             in;
+    float *             out;
+    float *             far;
+
+    aec_t *             aec;
+    ns_t *              ns;
+    agc_t               agc;
+    biquad_t            hpf[2];     // fourth order Butterworth
+
+    // Without speech, noise suppression and echo path adaptation are
+    // skipped, unless alsa.acoustics.vad.skip is 0.
+    vad_t               vad;
+    bool                skip;
+    uint32_t            blocks;
+    uint32_t            speechBlocks;
+
+    // Multichannel capture goes through the beamformer when the geometry
+    // matches the channels; otherwise the channels are averaged.
+    float *             mic;
+    beam_t              beam;
+    bool                beamed;
+    acoustic_geometry_t geometry;
+    volatile bool       steer;      // geometry changed
+
+    // Far-end reference, mono at the capture rate, and the play time of
+    // one of its samples.
+    float *             ref;
+    uint32_t            refSize;
+    uint32_t            refWrite;
+    uint32_t            refRead;
+    bool                refSynced;
+    uint32_t            refAnchor;
+    nsecs_t             refTime;
+    nsecs_t             playTime;   // of the next write, or 0
+    uint32_t            refStep;    // playback frames per reference sample, Q16
+    uint32_t            refPhase;
+    float               refPrev;
+    float               refCur;
+
+    // Processing cost, in thread CPU time per second of audio, in total
+    // and for each stage.
+    nsecs_t             cpuTime;
+    uint32_t            cpuFrames;
+    nsecs_t             stageTime[STAGE_COUNT];
+};
+
+static acoustics_t *state(acoustic_device_t *dev)
+{
+    return (acoustics_t *)dev->modPrivate;
+}
+
+static void release(acoustics_t *st)
+{
+    aec_destroy(st->aec);
+    st->aec = NULL;
+
+    ns_destroy(st->ns);
+    st->ns = NULL;
+
+    free(st->work);
+    st->work = NULL;
+
+    free(st->mic);
+    st->mic = NULL;
+    st->beamed = false;
+
+    free(st->ref);
+    st->ref = NULL;
+
+    st->capture = NULL;
+}
+
+//
+// Everything the capture path needs is allocated here, so that processing
+// itself never allocates.
+//
+static status_t setup(acoustics_t *st, alsa_handle_t *h)
+{
+    st->rate = h->sampleRate;
+    st->channels = h->channels;
+
+    // Blocks of the largest power of two frames in 8 ms, 64 at least, and
+    // alsa.acoustics.aec.tail_ms of echo.
+    st->block = 64;
+    while (st->block * 2 * 1000 <= 8 * st->rate) st->block <<= 1;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("alsa.acoustics.aec.tail_ms", value, "128");
+
+    int parts = ((uint64_t)atoi(value) * st->rate / 1000 + st->block - 1) / st->block;
+    if (parts < 1) parts = 1;
+
+    st->refSize = 1;
+    while (st->refSize < st->rate) st->refSize <<= 1;
+
+    // Noise floor (alsa.acoustics.ns.floor_db), AGC target and maximum
+    // gain (alsa.acoustics.agc.target_db, .max_db), high-pass corner
+    // (alsa.acoustics.hpf_hz).
+    property_get("alsa.acoustics.ns.floor_db", value, "-20");
+    float floor = powf(10, atof(value) / 20);
+
+    char max[PROPERTY_VALUE_MAX];
+    property_get("alsa.acoustics.agc.target_db", value, "-18");
+    property_get("alsa.acoustics.agc.max_db", max, "24");
+    agc_init(&st->agc, atof(value), atof(max));
+
+    // Voice activity threshold over the noise floor
+    // (alsa.acoustics.vad.threshold_db), held for 300 ms.
+    property_get("alsa.acoustics.vad.threshold_db", value, "9");
+    vad_init(&st->vad, atof(value), (300 * st->rate / 1000 + st->block - 1) / st->block);
+
+    property_get("alsa.acoustics.vad.skip", value, "1");
+    st->skip = atoi(value);
+
+    property_get("alsa.acoustics.hpf_hz", value, "100");
+    biquad_highpass(&st->hpf[0], atof(value), st->rate, 0.5412f);
+    biquad_highpass(&st->hpf[1], atof(value), st->rate, 1.3066f);
+
+    // A linear array along x with alsa.acoustics.mic.spacing_mm between
+    // microphones, steered alsa.acoustics.mic.look_deg away from its axis
+    // towards the first microphone, unless set_params() says otherwise.
+    if (st->channels > 1 && st->geometry.tag != ACOUSTICS_GEOMETRY_TAG) {
+        property_get("alsa.acoustics.mic.spacing_mm", value, "0");
+        float spacing = atof(value) / 1000;
+        property_get("alsa.acoustics.mic.look_deg", value, "90");
+        float look = atof(value) * M_PI / 180;
+
+        if (spacing > 0) {
+            memset(&st->geometry, 0, sizeof(st->geometry));
+            st->geometry.count = st->channels > ACOUSTICS_MAX_MICS ?
+                ACOUSTICS_MAX_MICS : st->channels;
+            for (int m = 0; m < st->geometry.count; m++)
+                st->geometry.position[m][0] = m * spacing;
+            st->geometry.look[0] = -cosf(look);
+            st->geometry.look[1] = sinf(look);
+            st->geometry.tag = ACOUSTICS_GEOMETRY_TAG;
+        }
+    }
+
+    if (st->channels > 1)
+        st->mic = (float *)calloc(st->channels * (BEAM_HISTORY + st->block), sizeof(float));
+    st->steer = true;
+
+    st->work = (float *)calloc(3 * st->block, sizeof(float));
+    st->ref = (float *)calloc(st->refSize, sizeof(float));
+    st->aec = aec_create(st->block, parts);
+    st->ns = ns_create(st->block, floor);
+
+    if (!st->work || !st->ref || !st->aec || !st->ns || (st->channels > 1 && !st->mic)) {
+        release(st);
+        return NO_MEMORY;
+    }
+
+    st->in = st->work;
+    st->out = st->in + st->block;
+    st->far = st->out + st->block;
+    st->fill = 0;
+    st->time = 0;
+    st->refWrite = st->refRead = 0;
+    st->refSynced = false;
+    st->refTime = 0;
+    st->refStep = 0;
+    st->refPrev = st->refCur = 0;
+    st->cpuTime = 0;
+    st->cpuFrames = 0;
+    memset(st->stageTime, 0, sizeof(st->stageTime));
+    st->blocks = 0;
+    st->speechBlocks = 0;
+    st->capture = h;
+
+    LOGI("Capture processing at %u Hz, blocks of %d, %d echo partitions",
+         st->rate, st->block, parts);
+
+    return NO_ERROR;
+}
+
+//
+// The far-end block that was playing when 'time' was captured. Called with
+// lock held. Successive blocks are contiguous unless the timestamps drift
+// apart by more than half a block.
+//
+static void reference(acoustics_t *st, nsecs_t time)
+{
+    uint32_t mask = st->refSize - 1;
+
+    if (st->refTime) {
+        uint32_t target = st->refAnchor +
+            (int32_t)((time - st->refTime) * st->rate / 1000000000LL);
+
+        int32_t drift = target - st->refRead;
+        if (!st->refSynced || drift > st->block / 2 || drift < -st->block / 2) {
+            st->refRead = target;
+            st->refSynced = true;
+        }
+    }
+
+    for (int i = 0; i < st->block; i++) {
+        uint32_t pos = st->refRead + i;
+        uint32_t age = st->refWrite - pos;
+
+        st->far[i] = st->refTime && age - 1 < st->refSize - 1 ? st->ref[pos & mask] : 0;
+    }
+
+    st->refRead += st->block;
+}
+
+//
+// Pick up the flags set_params() asked for, starting the stages being
+// switched on over: the echo path and the noise may have changed while
+// they were off. Called with lock held.
+//
+static void reconfigure(acoustics_t *st)
+{
+    st->update = false;
+
+    if ((st->resets & ACOUSTICS_AEC_ENABLE) && st->aec) {
+        aec_reset(st->aec);
+        st->refSynced = false;
+    }
+
+    if ((st->resets & AudioSystem::NS_ENABLE) && st->ns)
+        ns_reset(st->ns);
+
+    if (st->resets & AudioSystem::AGC_ENABLE) {
+        st->agc.gain = 1;
+        st->agc.level = 0;
+    }
+
+    if (st->resets & AudioSystem::TX_IIR_ENABLE)
+        for (int i = 0; i < 2; i++)
+            st->hpf[i].z1 = st->hpf[i].z2 = 0;
+
+    st->resets = 0;
+    st->flags = st->nextFlags;
+}
+
+//
+// Pick up a new geometry. Called with lock held.
+//
+static void steer(acoustics_t *st)
+{
+    st->steer = false;
+    st->beamed = st->mic && st->geometry.tag == ACOUSTICS_GEOMETRY_TAG &&
+        st->geometry.count == (int)st->channels;
+
+    if (!st->beamed) return;
+
+    beam_steer(&st->beam, &st->geometry, st->rate);
+
+    int delay = 0;
+    for (int m = 0; m < st->beam.count; m++)
+        if (st->beam.delay[m] > delay) delay = st->beam.delay[m];
+
+    LOGI("Beamforming %d microphones, delays up to %d samples",
+         st->beam.count, delay);
+}
+
+//
+// Run the enabled stages over the block in 'in', captured at 'time':
+// high-pass, voice activity, echo cancellation, noise suppression, then
+// gain control.
+//
+static void process(acoustics_t *st, nsecs_t time)
+{
+    uint32_t flags = st->flags;
+    nsecs_t t0 = systemTime(SYSTEM_TIME_THREAD), t1;
+
+    if (flags & AudioSystem::TX_IIR_ENABLE) {
+        biquad_run(&st->hpf[0], st->in, st->block);
+        biquad_run(&st->hpf[1], st->in, st->block);
+
+        t1 = systemTime(SYSTEM_TIME_THREAD);
+        st->stageTime[STAGE_HPF] += t1 - t0;
+        t0 = t1;
+    }
+
+    bool speech = vad_process(&st->vad, st->in, st->block);
+    bool idle = st->skip && !speech;
+
+    st->blocks++;
+    if (speech) st->speechBlocks++;
+
+    t1 = systemTime(SYSTEM_TIME_THREAD);
+    st->stageTime[STAGE_VAD] += t1 - t0;
+    t0 = t1;
+
+    if ((flags & ACOUSTICS_AEC_ENABLE) && st->playback) {
+        {
+            AutoMutex lock(st->lock);
+            reference(st, time);
+        }
+
+        aec_process(st->aec, st->far, st->in, !idle);
+
+        t1 = systemTime(SYSTEM_TIME_THREAD);
+        st->stageTime[STAGE_AEC] += t1 - t0;
+        t0 = t1;
+    }
+
+    if (flags & AudioSystem::NS_ENABLE) {
+        if (idle)
+            ns_bypass(st->ns, st->in);
+        else
+            ns_process(st->ns, st->in, speech);
+
+        t1 = systemTime(SYSTEM_TIME_THREAD);
+        st->stageTime[STAGE_NS] += t1 - t0;
+        t0 = t1;
+    }
+
+    if (flags & AudioSystem::AGC_ENABLE) {
+        agc_process(&st->agc, st->in, st->block);
+
+        st->stageTime[STAGE_AGC] += systemTime(SYSTEM_TIME_THREAD) - t0;
+    }
+
+    float *t = st->in;
+    st->in = st->out;
+    st->out = t;
+}
+
+// ----------------------------------------------------------------------------
+
+static void init(acoustics_t *st)
+{
+    st->capture = NULL;
+    st->playback = NULL;
+    st->flags = 0;
+    st->nextFlags = 0;
+    st->resets = 0;
+    st->update = false;
+    st->work = NULL;
+    st->ref = NULL;
+    st->aec = NULL;
+    st->ns = NULL;
+    st->mic = NULL;
+    st->beamed = false;
+    st->geometry.tag = 0;
+    st->steer = false;
+    st->playTime = 0;
+}
+
+//
+// Processing cost at 8, 16 and 48 kHz with every stage on, logged at open
+// when alsa.acoustics.benchmark is set. Two seconds of synthetic capture
+// go through setup() and process(): the echo of a noise far end 5 ms
+// later, a faint noise floor, and a tone in every other half second for
+// speech.
+//
+static void benchmark()
+{
+    static const uint32_t rates[] = { 8000, 16000, 48000 };
+    static const int SECONDS = 2;
+
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        acoustics_t *st = new acoustics_t;
+        alsa_handle_t h;
+
+        init(st);
+        memset(&h, 0, sizeof(h));
+        h.devices = AudioSystem::DEVICE_IN_BUILTIN_MIC;
+        h.format = SND_PCM_FORMAT_S16_LE;
+        h.sampleRate = rates[r];
+        h.channels = 1;
+
+        if (setup(st, &h) != NO_ERROR) {
+            LOGE("Benchmark at %u Hz: out of memory", rates[r]);
+            delete st;
+            continue;
+        }
+
+        st->flags = ACOUSTICS_AEC_ENABLE | AudioSystem::NS_ENABLE |
+                    AudioSystem::AGC_ENABLE | AudioSystem::TX_IIR_ENABLE;
+        st->playback = &h;
+        st->refTime = 1;
+        st->refAnchor = 0;
+
+        uint32_t rate = st->rate, mask = st->refSize - 1, seed = 1;
+        uint32_t delay = rate / 200;
+        nsecs_t period = 1000000000LL / rate;
+        int blocks = SECONDS * rate / st->block;
+        nsecs_t cpu = 0;
+
+        for (int b = 0; b < blocks; b++) {
+            uint32_t start = b * st->block;
+
+            for (int i = 0; i < st->block; i++) {
+                uint32_t n = start + i;
+
+                seed = seed * 1664525 + 1013904223;
+                st->ref[st->refWrite++ & mask] = 0.3f * ((int32_t)seed >> 16) / 32768;
+
+                seed = seed * 1664525 + 1013904223;
+                float sample = 0.005f * ((int32_t)seed >> 16) / 32768;
+                if (n >= delay) sample += 0.1f * st->ref[(n - delay) & mask];
+                if ((n * 2 / rate) & 1) sample += 0.5f * sinf(2 * M_PI * 220 * n / rate);
+
+                st->in[i] = sample;
+            }
+
+            nsecs_t t0 = systemTime(SYSTEM_TIME_THREAD);
+            process(st, 1 + start * period);
+            cpu += systemTime(SYSTEM_TIME_THREAD) - t0;
+        }
+
+        LOGI("Benchmark at %u Hz: %lld us of CPU per second of audio "
+             "(hpf %lld, vad %lld, aec %lld, ns %lld, agc %lld), speech in %u%% of blocks",
+             rate, ns2us(cpu) / SECONDS,
+             ns2us(st->stageTime[STAGE_HPF]) / SECONDS,
+             ns2us(st->stageTime[STAGE_VAD]) / SECONDS,
+             ns2us(st->stageTime[STAGE_AEC]) / SECONDS,
+             ns2us(st->stageTime[STAGE_NS]) / SECONDS,
+             ns2us(st->stageTime[STAGE_AGC]) / SECONDS,
+             st->blocks ? st->speechBlocks * 100 / st->blocks : 0);
+
+        release(st);
+        delete st;
+    }
+}
+
 static int s_device_open(const hw_module_t* module, const char* name,
         hw_device_t** device)
 {
@@ -56,6 +1387,14 @@ static int s_device_open(const hw_module_t* module, const char* name,
 
     memset(dev, 0, sizeof(*dev));
 
+    acoustics_t *st = new acoustics_t;
+    if (!st) {
+        free(dev);
+        return -ENOMEM;
+    }
+
+    init(st);
+
     /* initialize the procs */
     dev->common.tag = HARDWARE_DEVICE_TAG;
     dev->common.version = 0;
@@ -67,7 +1406,19 @@ static int s_device_open(const hw_module_t* module, const char* name,
     dev->cleanup = s_cleanup;
     dev->set_params = s_set_params;
 
-    // read, write, and recover are optional methods...
+    // Optional methods...
+    dev->read = s_read;
+    dev->write = s_write;
+    dev->recover = s_recover;
+    dev->timestamp = s_timestamp;
+    dev->process = s_process;
+    dev->activity = s_activity;
+
+    dev->modPrivate = st;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("alsa.acoustics.benchmark", value, "0");
+    if (atoi(value)) benchmark();
 
     *device = &dev->common;
     return 0;
@@ -75,25 +1426,247 @@ static int s_device_open(const hw_module_t* module, const char* name,
 
 static int s_device_close(hw_device_t* device)
 {
+    acoustic_device_t *dev = (acoustic_device_t *)device;
+    acoustics_t *st = state(dev);
+
+    release(st);
+    delete st;
+
     free(device);
     return 0;
 }
 
 static status_t s_use_handle(acoustic_device_t *dev, alsa_handle_t *h)
 {
-    return NO_ERROR;
+    acoustics_t *st = state(dev);
+    AutoMutex lock(st->lock);
+
+    if (h->devices & AudioSystem::DEVICE_OUT_ALL) {
+        st->playback = h;
+        st->refTime = 0;
+        return NO_ERROR;
+    }
+
+    release(st);
+
+    if (h->format != SND_PCM_FORMAT_S16_LE) {
+        LOGW("Capture processing needs 16 bit samples, passing capture through");
+        st->capture = h;
+        return NO_ERROR;
+    }
+
+    return setup(st, h);
 }
 
 static status_t s_cleanup(acoustic_device_t *dev)
 {
-    LOGD("Acoustics close stub called.");
+    acoustics_t *st = state(dev);
+    AutoMutex lock(st->lock);
+
+    release(st);
+
     return NO_ERROR;
 }
 
 static status_t s_set_params(acoustic_device_t *dev,
         AudioSystem::audio_in_acoustics acoustics, void *params)
 {
-    LOGD("Acoustics set_params stub called with %d.", (int)acoustics);
+    acoustics_t *st = state(dev);
+    AutoMutex lock(st->lock);
+
+    LOGD("Acoustics set_params called with %d.", (int)acoustics);
+
+    // Processing may be under way on another thread: the change waits
+    // for the next call to process().
+    st->resets |= acoustics & ~st->nextFlags;
+    st->nextFlags = acoustics;
+    st->update = true;
+
+    const acoustic_geometry_t *geometry = (const acoustic_geometry_t *)params;
+
+    if (geometry && geometry->tag == ACOUSTICS_GEOMETRY_TAG) {
+        if (geometry->count < 1 || geometry->count > ACOUSTICS_MAX_MICS)
+            return BAD_VALUE;
+
+        st->geometry = *geometry;
+        st->steer = true;
+    }
+
+    return NO_ERROR;
+}
+
+static void s_timestamp(acoustic_device_t *dev, snd_pcm_stream_t stream,
+        int64_t frames, nsecs_t time)
+{
+    acoustics_t *st = state(dev);
+
+    if (stream == SND_PCM_STREAM_CAPTURE)
+        st->time = time;
+    else {
+        AutoMutex lock(st->lock);
+        st->playTime = time;
+    }
+}
+
+static ssize_t s_read(acoustic_device_t *dev, void *buffer, size_t bytes)
+{
+    acoustics_t *st = state(dev);
+    alsa_handle_t *h = st->capture;
+
+    if (!h || !h->handle) return -EBADFD;
+
+    snd_pcm_sframes_t n = snd_pcm_readi(h->handle, buffer,
+            snd_pcm_bytes_to_frames(h->handle, bytes));
+
+    if (n <= 0) return n;
+
+    return s_process(dev, buffer, snd_pcm_frames_to_bytes(h->handle, n));
+}
+
+//
+// Process capture frames read by someone else. This may run on a thread of
+// its own, without the capture PCM lock, so it never touches the PCM: the
+// frame size comes from the configuration setup() recorded.
+//
+static ssize_t s_process(acoustic_device_t *dev, void *buffer, size_t bytes)
+{
+    acoustics_t *st = state(dev);
+
+    if (!st->capture) return -EBADFD;
+    if (!st->work) return bytes;
+
+    snd_pcm_sframes_t n = bytes / (st->channels * sizeof(int16_t));
+
+    nsecs_t begin = systemTime(SYSTEM_TIME_THREAD);
+    nsecs_t period = 1000000000LL / st->rate;
+
+    int16_t *pcm = (int16_t *)buffer;
+    int channels = st->channels;
+    int stride = BEAM_HISTORY + st->block;
+
+    if (st->update) {
+        AutoMutex lock(st->lock);
+        reconfigure(st);
+    }
+
+    if (st->steer) {
+        AutoMutex lock(st->lock);
+        steer(st);
+    }
+
+    // Channels are mixed down, or beamformed, processed once, and the
+    // result is copied back to every channel.
+    for (snd_pcm_sframes_t i = 0; i < n; i++, pcm += channels) {
+        float v = st->out[st->fill] * 32768.0f;
+        int16_t s = v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t)v;
+
+        if (st->beamed) {
+            float *mic = st->mic + BEAM_HISTORY + st->fill;
+            for (int c = 0; c < channels; c++) mic[c * stride] = pcm[c] * (1.0f / 32768);
+        } else {
+            int sum = 0;
+            for (int c = 0; c < channels; c++) sum += pcm[c];
+            st->in[st->fill] = sum / (32768.0f * channels);
+        }
+
+        for (int c = 0; c < channels; c++) pcm[c] = s;
+
+        if (++st->fill == st->block) {
+            if (st->beamed) beam_run(&st->beam, st->mic, stride, st->in, st->block);
+            process(st, st->time + (i + 1 - st->block) * period);
+            st->fill = 0;
+        }
+    }
+
+    st->time += n * period;
+
+    st->cpuTime += systemTime(SYSTEM_TIME_THREAD) - begin;
+    st->cpuFrames += n;
+
+    if (st->cpuFrames >= 10 * st->rate) {
+        LOGI("Capture processing at %u Hz: %lld us of CPU per second of audio "
+             "(hpf %lld, vad %lld, aec %lld, ns %lld, agc %lld), speech in %u%% of blocks",
+             st->rate, ns2us(st->cpuTime) * st->rate / st->cpuFrames,
+             ns2us(st->stageTime[STAGE_HPF]) * st->rate / st->cpuFrames,
+             ns2us(st->stageTime[STAGE_VAD]) * st->rate / st->cpuFrames,
+             ns2us(st->stageTime[STAGE_AEC]) * st->rate / st->cpuFrames,
+             ns2us(st->stageTime[STAGE_NS]) * st->rate / st->cpuFrames,
+             ns2us(st->stageTime[STAGE_AGC]) * st->rate / st->cpuFrames,
+             st->blocks ? st->speechBlocks * 100 / st->blocks : 0);
+        st->cpuTime = 0;
+        st->cpuFrames = 0;
+        st->blocks = 0;
+        st->speechBlocks = 0;
+        memset(st->stageTime, 0, sizeof(st->stageTime));
+    }
+
+    return n * st->channels * sizeof(int16_t);
+}
+
+//
+// Reference tee of the playback data: mixed to mono and resampled to the
+// capture rate.
+//
+static ssize_t s_write(acoustic_device_t *dev, const void *buffer, size_t bytes)
+{
+    acoustics_t *st = state(dev);
+    AutoMutex lock(st->lock);
+
+    alsa_handle_t *h = st->playback;
+
+    if (!h || !st->ref || !(st->flags & ACOUSTICS_AEC_ENABLE) ||
+        h->format != SND_PCM_FORMAT_S16_LE)
+        return bytes;
+
+    uint32_t step = ((uint64_t)h->sampleRate << 16) / st->rate;
+    if (step != st->refStep) {
+        st->refStep = step;
+        st->refPhase = 0x10000;
+    }
+
+    if (st->playTime) {
+        st->refAnchor = st->refWrite;
+        st->refTime = st->playTime;
+        st->playTime = 0;
+    }
+
+    const int16_t *pcm = (const int16_t *)buffer;
+    int channels = h->channels;
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    uint32_t mask = st->refSize - 1;
+
+    for (size_t i = 0; i < frames; i++, pcm += channels) {
+        int sum = 0;
+        for (int c = 0; c < channels; c++) sum += pcm[c];
+
+        st->refPrev = st->refCur;
+        st->refCur = sum / (32768.0f * channels);
+        st->refPhase -= 0x10000;
+
+        // Emit the reference samples that fall before this frame.
+        for (; st->refPhase < 0x10000; st->refPhase += step)
+            st->ref[st->refWrite++ & mask] = st->refPrev +
+                (st->refCur - st->refPrev) * st->refPhase * (1.0f / 0x10000);
+    }
+
+    return bytes;
+}
+
+static int s_activity(acoustic_device_t *dev)
+{
+    acoustics_t *st = state(dev);
+
+    return st->work ? st->vad.speech : -1;
+}
+
+static status_t s_recover(acoustic_device_t *dev, int err)
+{
+    acoustics_t *st = state(dev);
+
+    // Frames went missing: realign the blocks with the reference.
+    st->fill = 0;
+    st->refSynced = false;
+
     return NO_ERROR;
 }
 }
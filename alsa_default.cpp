@@ -108,6 +108,7 @@ static alsa_handle_t _defaultsOut = {
     sampleRate  : DEFAULT_SAMPLE_RATE,
     latency     : 200000, // Desired Delay in usec
     bufferSize  : DEFAULT_SAMPLE_RATE / 5, // Desired Number of samples
+    periodSize  : 0,
     modPrivate  : 0,
 };
 
@@ -122,6 +123,7 @@ static alsa_handle_t _defaultsIn = {
     sampleRate  : AudioRecord::DEFAULT_SAMPLE_RATE,
     latency     : 250000, // Desired Delay in usec
     bufferSize  : 2048, // Desired Number of samples
+    periodSize  : 0,
     modPrivate  : 0,
 };
 
@@ -344,7 +346,17 @@ status_t setHardwareParams(alsa_handle_t *handle)
 
     // Commit the hardware parameters back to the device.
     err = snd_pcm_hw_params(handle->handle, hardwareParams);
-    if (err < 0) LOGE("Unable to set hardware parameters: %s", snd_strerror(err));
+    if (err < 0) {
+        LOGE("Unable to set hardware parameters: %s", snd_strerror(err));
+        goto done;
+    }
+
+    {
+        snd_pcm_uframes_t periodSize;
+        if (snd_pcm_hw_params_get_period_size(hardwareParams, &periodSize, NULL) == 0)
+            handle->periodSize = periodSize;
+        LOGV("Period size: %d", (int)handle->periodSize);
+    }
 
     done:
     snd_pcm_hw_params_free(hardwareParams);
@@ -383,9 +395,12 @@ status_t setSoftwareParams(alsa_handle_t *handle)
         stopThreshold = bufferSize;
     } else {
         // For recording, configure ALSA to start the transfer on the
-        // first frame.
+        // first frame, and never to stop it: on an overrun the hardware
+        // overwrites the oldest frames, and the capture thread skips just
+        // those instead of restarting the PCM.
         startThreshold = 1;
-        stopThreshold = bufferSize;
+        if (snd_pcm_sw_params_get_boundary(softwareParams, &stopThreshold) < 0)
+            stopThreshold = bufferSize;
     }
 
     err = snd_pcm_sw_params_set_start_threshold(handle->handle, softwareParams,
@@ -404,6 +419,15 @@ status_t setSoftwareParams(alsa_handle_t *handle)
         goto done;
     }
 
+    // Timestamp every status update, so snd_pcm_htimestamp() can tell when
+    // the frames at the ends of the buffer were converted.
+    err = snd_pcm_sw_params_set_tstamp_mode(handle->handle, softwareParams,
+            SND_PCM_TSTAMP_ENABLE);
+    if (err < 0) {
+        LOGE("Unable to enable timestamps: %s", snd_strerror(err));
+        goto done;
+    }
+
     // Allow the transfer to start when at least periodSize samples can be
     // processed.
     err = snd_pcm_sw_params_set_avail_min(handle->handle, softwareParams,